@@ -10,9 +10,17 @@ enum {
 };
 
 typedef struct ps_queue_s ps_queue_t;
+typedef void (*ps_queue_notify_t)(void *ctx);
 
 ps_queue_t *ps_new_queue(size_t sz);
 void ps_free_queue(ps_queue_t *q);
 int ps_queue_push(ps_queue_t *q, ps_msg_t *msg, uint8_t priority);
+// Pushes n messages under a single lock, storing each push result. Returns the number of PS_QUEUE_OK results.
+size_t ps_queue_push_many(ps_queue_t *q, ps_msg_t *const *msgs, const uint8_t *priorities, int *results, size_t n);
 ps_msg_t *ps_queue_pull(ps_queue_t *q, int64_t timeout);
-size_t ps_queue_waiting(ps_queue_t *q);
\ No newline at end of file
+// Waits for one message and pulls up to max under a single lock. Returns the number of messages pulled.
+size_t ps_queue_pull_many(ps_queue_t *q, ps_msg_t **msgs, size_t max, int64_t timeout);
+size_t ps_queue_waiting(ps_queue_t *q);
+// Sets the function called, outside the queue lock, once per empty to non-empty transition of the queue.
+// It is called right away if the queue already holds messages.
+void ps_queue_set_notify(ps_queue_t *q, ps_queue_notify_t fn, void *ctx);
\ No newline at end of file
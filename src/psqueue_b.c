@@ -4,51 +4,94 @@
 
 #include <stdlib.h>
 #include "sync.h"
-#include "utlist.h"
 #include "pubsub.h"
 
 #define PRIORITIES 10 // 0-9 priorities
+#define NIL UINT32_MAX
 
-typedef struct node_s {
-	struct node_s *prev;
-	struct node_s *next;
+// Slots live in a single array and are linked by index, either in a priority list or in the free list
+typedef struct slot_s {
 	ps_msg_t *msg;
-} node_t;
+	uint32_t prev;
+	uint32_t next;
+} slot_t;
+
+typedef struct list_s {
+	uint32_t head; // Oldest
+	uint32_t tail; // Newest
+} list_t;
 
 struct ps_queue_s {
-	node_t *priorities[PRIORITIES];
-	node_t *available;
+	list_t priorities[PRIORITIES];
+	uint32_t available; // Free list of released slots
+	uint32_t unused;    // Slots from here on were never used, so creating a big queue doesn't touch its memory
+	uint32_t size;
+	uint32_t count; // Messages in the priority lists
+	ps_queue_notify_t notify;
+	void *notify_ctx;
 	mutex_t mux;
 	semaphore_t not_empty;
+	slot_t slots[];
 };
 
 ps_queue_t *ps_new_queue(size_t sz) {
-	ps_queue_t *q = calloc(1, sizeof(ps_queue_t));
+	ps_queue_t *q = calloc(1, sizeof(ps_queue_t) + sz * sizeof(slot_t));
 	mutex_init(&q->mux);
 	semaphore_init(&q->not_empty, 0);
 
-	for (size_t i = 0; i < sz; i++) {
-		node_t *n = (node_t *) calloc(1, sizeof(node_t));
-		DL_APPEND(q->available, n);
+	for (size_t i = 0; i < PRIORITIES; i++) {
+		q->priorities[i].head = q->priorities[i].tail = NIL;
 	}
+	q->available = NIL;
+	q->size = sz;
 
 	return q;
 }
 
-static int bqueue_get_available(ps_queue_t *q, node_t **n, uint8_t max_prio) {
-	if (q->available != NULL) {
+static void list_append(ps_queue_t *q, list_t *l, uint32_t n) {
+	q->slots[n].prev = l->tail;
+	q->slots[n].next = NIL;
+	if (l->tail == NIL) {
+		l->head = n;
+	} else {
+		q->slots[l->tail].next = n;
+	}
+	l->tail = n;
+}
+
+static void list_delete(ps_queue_t *q, list_t *l, uint32_t n) {
+	slot_t *slot = &q->slots[n];
+	if (slot->prev == NIL) {
+		l->head = slot->next;
+	} else {
+		q->slots[slot->prev].next = slot->next;
+	}
+	if (slot->next == NIL) {
+		l->tail = slot->prev;
+	} else {
+		q->slots[slot->next].prev = slot->prev;
+	}
+}
+
+static int bqueue_get_available(ps_queue_t *q, uint32_t *n, uint8_t max_prio) {
+	if (q->available != NIL) {
 		*n = q->available;
-		DL_DELETE(q->available, q->available);
+		q->available = q->slots[*n].next;
+		return PS_QUEUE_OK;
+	}
+	if (q->unused < q->size) {
+		*n = q->unused++;
 		return PS_QUEUE_OK;
 	}
 
 	// There is none available, we need to drop the one with the lowest priority
 	for (size_t i = 0; i < max_prio; i++) {
-		if (q->priorities[i] != NULL) {
-			*n = q->priorities[i]->prev;
-			ps_unref_msg((*n)->msg);
-			(*n)->msg = NULL;
-			DL_DELETE(q->priorities[i], *n);
+		if (q->priorities[i].tail != NIL) {
+			*n = q->priorities[i].tail;
+			ps_unref_msg(q->slots[*n].msg);
+			q->slots[*n].msg = NULL;
+			list_delete(q, &q->priorities[i], *n);
+			q->count--;
 			return PS_QUEUE_EOVERFLOW;
 		}
 	}
@@ -58,12 +101,14 @@ static int bqueue_get_available(ps_queue_t *q, node_t **n, uint8_t max_prio) {
 
 static void bqueue_get(ps_queue_t *q, ps_msg_t **msg) {
 	for (int i = PRIORITIES - 1; i >= 0; i--) {
-		if (q->priorities[i] != NULL) {
-			node_t *n = q->priorities[i];
-			*msg = n->msg;
-			DL_DELETE(q->priorities[i], n);
-			n->msg = NULL;
-			DL_APPEND(q->available, n);
+		uint32_t n = q->priorities[i].head;
+		if (n != NIL) {
+			*msg = q->slots[n].msg;
+			list_delete(q, &q->priorities[i], n);
+			q->count--;
+			q->slots[n].msg = NULL;
+			q->slots[n].next = q->available;
+			q->available = n;
 			return;
 		}
 	}
@@ -71,27 +116,18 @@ static void bqueue_get(ps_queue_t *q, ps_msg_t **msg) {
 	return;
 }
 
-static void bqueue_insert(ps_queue_t *q, node_t *n, uint8_t priority) {
-	DL_APPEND(q->priorities[priority], n);
+static void bqueue_insert(ps_queue_t *q, uint32_t n, uint8_t priority) {
+	list_append(q, &q->priorities[priority], n);
+	q->count++;
 }
 
 void ps_free_queue(ps_queue_t *q) {
-	node_t *n = NULL;
-	node_t *e = NULL;
-
 	for (size_t i = 0; i < PRIORITIES; i++) {
-		DL_FOREACH_SAFE (q->priorities[i], n, e) {
-			ps_unref_msg(n->msg);
-			DL_DELETE(q->priorities[i], n);
-			free(n);
+		for (uint32_t n = q->priorities[i].head; n != NIL; n = q->slots[n].next) {
+			ps_unref_msg(q->slots[n].msg);
 		}
 	}
 
-	DL_FOREACH_SAFE (q->available, n, e) {
-		DL_DELETE(q->available, n);
-		free(n);
-	}
-
 	mutex_destroy(&q->mux);
 	semaphore_destroy(&q->not_empty);
 	free(q);
@@ -99,23 +135,60 @@ void ps_free_queue(ps_queue_t *q) {
 
 int ps_queue_push(ps_queue_t *q, ps_msg_t *msg, uint8_t priority) {
 	int ret = 0;
+	ps_queue_notify_t notify = NULL;
 	mutex_lock(q->mux);
 
-	node_t *n = NULL;
+	if (q->count == 0)
+		notify = q->notify;
+	uint32_t n = NIL;
 	ret = bqueue_get_available(q, &n, priority);
 
 	if (ret != PS_QUEUE_EFULL) {
-		n->msg = msg;
+		q->slots[n].msg = msg;
 		bqueue_insert(q, n, priority);
 
 		if (ret == PS_QUEUE_OK)
 			semaphore_post(q->not_empty);
+	} else {
+		notify = NULL;
 	}
 
 	mutex_unlock(q->mux);
+	if (notify != NULL)
+		notify(q->notify_ctx);
 	return ret;
 }
 
+size_t ps_queue_push_many(ps_queue_t *q, ps_msg_t *const *msgs, const uint8_t *priorities, int *results, size_t n) {
+	size_t pushed = 0;
+	ps_queue_notify_t notify = NULL;
+	mutex_lock(q->mux);
+
+	if (q->count == 0)
+		notify = q->notify;
+	for (size_t i = 0; i < n; i++) {
+		uint32_t slot = NIL;
+		results[i] = bqueue_get_available(q, &slot, priorities[i]);
+
+		if (results[i] != PS_QUEUE_EFULL) {
+			q->slots[slot].msg = msgs[i];
+			bqueue_insert(q, slot, priorities[i]);
+
+			if (results[i] == PS_QUEUE_OK)
+				pushed++;
+		}
+	}
+	if (pushed > 0)
+		semaphore_post_n(q->not_empty, pushed);
+	else
+		notify = NULL;
+
+	mutex_unlock(q->mux);
+	if (notify != NULL)
+		notify(q->notify_ctx);
+	return pushed;
+}
+
 ps_msg_t *ps_queue_pull(ps_queue_t *q, int64_t timeout) {
 	ps_msg_t *msg = NULL;
 
@@ -129,9 +202,33 @@ ps_msg_t *ps_queue_pull(ps_queue_t *q, int64_t timeout) {
 	return msg;
 }
 
+size_t ps_queue_pull_many(ps_queue_t *q, ps_msg_t **msgs, size_t max, int64_t timeout) {
+	if (max == 0 || semaphore_wait(q->not_empty, timeout) < 0)
+		return 0;
+
+	size_t n = 1 + semaphore_trywait_n(q->not_empty, max - 1);
+	mutex_lock(q->mux);
+	for (size_t i = 0; i < n; i++) {
+		bqueue_get(q, &msgs[i]);
+	}
+	mutex_unlock(q->mux);
+
+	return n;
+}
+
 size_t ps_queue_waiting(ps_queue_t *q) {
 	int ret = semaphore_get(q->not_empty);
 	return ret < 0 ? 0 : ret;
 }
 
+void ps_queue_set_notify(ps_queue_t *q, ps_queue_notify_t fn, void *ctx) {
+	mutex_lock(q->mux);
+	q->notify = fn;
+	q->notify_ctx = ctx;
+	bool non_empty = q->count > 0;
+	mutex_unlock(q->mux);
+	if (fn != NULL && non_empty)
+		fn(ctx);
+}
+
 #endif
\ No newline at end of file
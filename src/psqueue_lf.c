@@ -0,0 +1,209 @@
+#include "psqueue.h"
+
+#ifdef PS_QUEUE_LOCKFREE
+
+#include <stdlib.h>
+#include <time.h>
+#include "sync.h"
+#include "pubsub.h"
+
+/*
+ * Bounded lock-free ring (D. Vyukov's MPMC queue): each slot carries a sequence number telling
+ * whether it is free for the producer or ready for the consumer at a given position, so push and
+ * pull only CAS their own position counter. The semaphore is only used to park consumers when
+ * the queue is empty. Priorities are not supported.
+ */
+
+typedef struct slot_s {
+	size_t seq;
+	ps_msg_t *msg;
+} slot_t;
+
+struct ps_queue_s {
+	size_t head __attribute__((aligned(64))); // Next position to push
+	size_t tail __attribute__((aligned(64))); // Next position to pull
+	size_t count __attribute__((aligned(64)));
+	uint32_t waiters;
+	uint32_t armed; // The consumer saw the queue empty, the next push must notify
+	size_t size __attribute__((aligned(64)));
+	size_t mask;
+	slot_t *slots;
+	semaphore_t wake;
+	ps_queue_notify_t notify;
+	void *notify_ctx;
+};
+
+ps_queue_t *ps_new_queue(size_t sz) {
+	ps_queue_t *q = calloc(1, sizeof(ps_queue_t));
+	size_t cap = 1;
+	while (cap < sz)
+		cap <<= 1;
+	q->size = sz;
+	q->mask = cap - 1;
+	q->slots = calloc(cap, sizeof(slot_t));
+	for (size_t i = 0; i < cap; i++) {
+		q->slots[i].seq = i;
+	}
+	semaphore_init(&q->wake, 0);
+
+	return q;
+}
+
+static ps_msg_t *lfqueue_pop(ps_queue_t *q) {
+	size_t pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+	for (;;) {
+		slot_t *slot = &q->slots[pos & q->mask];
+		size_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		intptr_t diff = (intptr_t) seq - (intptr_t) (pos + 1);
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&q->tail, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				ps_msg_t *msg = slot->msg;
+				__atomic_store_n(&slot->seq, pos + q->mask + 1, __ATOMIC_RELEASE);
+				__atomic_sub_fetch(&q->count, 1, __ATOMIC_RELAXED);
+				return msg;
+			}
+		} else if (diff < 0) {
+			return NULL; // Empty
+		} else {
+			pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+static int lfqueue_push(ps_queue_t *q, ps_msg_t *msg) {
+	size_t pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+	for (;;) {
+		// The ring is rounded up to a power of two, keep the requested bound (pos may be stale, hence signed)
+		if ((intptr_t) (pos - __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE)) >= (intptr_t) q->size) {
+			return PS_QUEUE_EFULL;
+		}
+		slot_t *slot = &q->slots[pos & q->mask];
+		size_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&q->head, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				slot->msg = msg;
+				__atomic_add_fetch(&q->count, 1, __ATOMIC_RELAXED);
+				__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+				return PS_QUEUE_OK;
+			}
+		} else if (diff < 0) {
+			return PS_QUEUE_EFULL;
+		} else {
+			pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+// Wakes a parked consumer, pairs with the waiters increment in ps_queue_pull and with lfqueue_arm
+static void lfqueue_wake(ps_queue_t *q) {
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&q->waiters, __ATOMIC_RELAXED) > 0)
+		semaphore_post(q->wake);
+
+	ps_queue_notify_t notify = __atomic_load_n(&q->notify, __ATOMIC_ACQUIRE);
+	if (notify != NULL && __atomic_load_n(&q->armed, __ATOMIC_RELAXED) &&
+	    __atomic_exchange_n(&q->armed, 0, __ATOMIC_RELAXED))
+		notify(q->notify_ctx);
+}
+
+// Called when a pull finds the queue empty. There is no lock to make "empty" and the next push atomic, so the
+// consumer arms the notification and checks again: either it gets the message or the producer sees the flag.
+static ps_msg_t *lfqueue_arm(ps_queue_t *q) {
+	if (__atomic_load_n(&q->notify, __ATOMIC_RELAXED) == NULL)
+		return NULL;
+	__atomic_store_n(&q->armed, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	return lfqueue_pop(q);
+}
+
+void ps_free_queue(ps_queue_t *q) {
+	ps_msg_t *msg;
+	while ((msg = lfqueue_pop(q)) != NULL) {
+		ps_unref_msg(msg);
+	}
+	semaphore_destroy(&q->wake);
+	free(q->slots);
+	free(q);
+}
+
+int ps_queue_push(ps_queue_t *q, ps_msg_t *msg, uint8_t priority) {
+	(void) priority; // This implementation has no priority
+	int ret = lfqueue_push(q, msg);
+	if (ret == PS_QUEUE_OK)
+		lfqueue_wake(q);
+	return ret;
+}
+
+size_t ps_queue_push_many(ps_queue_t *q, ps_msg_t *const *msgs, const uint8_t *priorities, int *results, size_t n) {
+	(void) priorities; // This implementation has no priority
+	size_t pushed = 0;
+	for (size_t i = 0; i < n; i++) {
+		results[i] = lfqueue_push(q, msgs[i]);
+		if (results[i] == PS_QUEUE_OK)
+			pushed++;
+	}
+	if (pushed > 0)
+		lfqueue_wake(q);
+	return pushed;
+}
+
+static int64_t now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+ps_msg_t *ps_queue_pull(ps_queue_t *q, int64_t timeout) {
+	ps_msg_t *msg = lfqueue_pop(q);
+	if (msg == NULL)
+		msg = lfqueue_arm(q);
+	int64_t deadline = timeout > 0 ? now_ms() + timeout : 0;
+	while (msg == NULL && timeout != 0) {
+		__atomic_add_fetch(&q->waiters, 1, __ATOMIC_SEQ_CST);
+		msg = lfqueue_pop(q); // A push may have missed our registration
+		if (msg == NULL) {
+			int ret = semaphore_wait(q->wake, timeout);
+			msg = lfqueue_pop(q);
+			if (ret < 0) {
+				timeout = 0; // Timed out, give up after the last try
+			} else if (timeout > 0) {
+				// A stale post or another consumer won the message, wait for what is left
+				timeout = deadline - now_ms();
+				if (timeout < 0)
+					timeout = 0;
+			}
+		}
+		__atomic_sub_fetch(&q->waiters, 1, __ATOMIC_SEQ_CST);
+	}
+	return msg;
+}
+
+size_t ps_queue_pull_many(ps_queue_t *q, ps_msg_t **msgs, size_t max, int64_t timeout) {
+	if (max == 0 || (msgs[0] = ps_queue_pull(q, timeout)) == NULL)
+		return 0;
+
+	size_t n = 1;
+	while (n < max && (msgs[n] = lfqueue_pop(q)) != NULL) {
+		n++;
+	}
+	if (n < max && (msgs[n] = lfqueue_arm(q)) != NULL)
+		n++;
+	return n;
+}
+
+size_t ps_queue_waiting(ps_queue_t *q) {
+	return __atomic_load_n(&q->count, __ATOMIC_RELAXED);
+}
+
+void ps_queue_set_notify(ps_queue_t *q, ps_queue_notify_t fn, void *ctx) {
+	q->notify_ctx = ctx;
+	__atomic_store_n(&q->notify, fn, __ATOMIC_RELEASE);
+	__atomic_store_n(&q->armed, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (fn != NULL && __atomic_load_n(&q->count, __ATOMIC_RELAXED) > 0 &&
+	    __atomic_exchange_n(&q->armed, 0, __ATOMIC_RELAXED))
+		fn(ctx);
+}
+
+#endif
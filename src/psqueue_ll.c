@@ -10,6 +10,8 @@ struct ps_queue_s {
 	size_t count;
 	size_t head;
 	size_t tail;
+	ps_queue_notify_t notify;
+	void *notify_ctx;
 	mutex_t mux;
 	semaphore_t not_empty;
 };
@@ -34,11 +36,14 @@ void ps_free_queue(ps_queue_t *q) {
 int ps_queue_push(ps_queue_t *q, ps_msg_t *msg, uint8_t priority) {
 	(void) priority; // This implementation has no priority
 	int ret = 0;
+	ps_queue_notify_t notify = NULL;
 	mutex_lock(q->mux);
 	if (q->count >= q->size) {
 		ret = -1;
 		goto exit_fn;
 	}
+	if (q->count == 0)
+		notify = q->notify;
 	q->messages[q->head] = msg;
 	if (++q->head >= q->size)
 		q->head = 0;
@@ -47,9 +52,40 @@ int ps_queue_push(ps_queue_t *q, ps_msg_t *msg, uint8_t priority) {
 
 exit_fn:
 	mutex_unlock(q->mux);
+	if (notify != NULL)
+		notify(q->notify_ctx);
 	return ret;
 }
 
+size_t ps_queue_push_many(ps_queue_t *q, ps_msg_t *const *msgs, const uint8_t *priorities, int *results, size_t n) {
+	(void) priorities; // This implementation has no priority
+	size_t pushed = 0;
+	ps_queue_notify_t notify = NULL;
+	mutex_lock(q->mux);
+	if (q->count == 0)
+		notify = q->notify;
+	for (size_t i = 0; i < n; i++) {
+		if (q->count >= q->size) {
+			results[i] = PS_QUEUE_EFULL;
+			continue;
+		}
+		q->messages[q->head] = msgs[i];
+		if (++q->head >= q->size)
+			q->head = 0;
+		q->count++;
+		results[i] = PS_QUEUE_OK;
+		pushed++;
+	}
+	if (pushed > 0)
+		semaphore_post_n(q->not_empty, pushed);
+	else
+		notify = NULL;
+	mutex_unlock(q->mux);
+	if (notify != NULL)
+		notify(q->notify_ctx);
+	return pushed;
+}
+
 ps_msg_t *ps_queue_pull(ps_queue_t *q, int64_t timeout) {
 	ps_msg_t *msg = NULL;
 
@@ -66,6 +102,23 @@ ps_msg_t *ps_queue_pull(ps_queue_t *q, int64_t timeout) {
 	return msg;
 }
 
+size_t ps_queue_pull_many(ps_queue_t *q, ps_msg_t **msgs, size_t max, int64_t timeout) {
+	if (max == 0 || semaphore_wait(q->not_empty, timeout) < 0)
+		return 0;
+
+	size_t n = 1 + semaphore_trywait_n(q->not_empty, max - 1);
+	mutex_lock(q->mux);
+	for (size_t i = 0; i < n; i++) {
+		msgs[i] = q->messages[q->tail];
+		if (++q->tail >= q->size)
+			q->tail = 0;
+	}
+	q->count -= n;
+	mutex_unlock(q->mux);
+
+	return n;
+}
+
 size_t ps_queue_waiting(ps_queue_t *q) {
 	size_t res = 0;
 	mutex_lock(q->mux);
@@ -74,4 +127,14 @@ size_t ps_queue_waiting(ps_queue_t *q) {
 	return res;
 }
 
+void ps_queue_set_notify(ps_queue_t *q, ps_queue_notify_t fn, void *ctx) {
+	mutex_lock(q->mux);
+	q->notify = fn;
+	q->notify_ctx = ctx;
+	bool non_empty = q->count > 0;
+	mutex_unlock(q->mux);
+	if (fn != NULL && non_empty)
+		fn(ctx);
+}
+
 #endif
\ No newline at end of file
@@ -4,30 +4,84 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 
 #include "pubsub.h"
-#include "uthash.h"
 #include "utlist.h"
 
 #include "sync.h"
 #include "psqueue.h"
 
-typedef struct subscriber_list_s {
+#define SUB_PRIO_MASK 0xFF
+#define SUB_HIDDEN 0x100
+#define SUB_ON_EMPTY 0x200
+#define SUB_REMOVED 0x400
+
+typedef struct subscriber_entry_s {
 	ps_subscriber_t *su;
-	bool hidden;
-	bool on_empty;
-	int8_t priority;
-	struct subscriber_list_s *next;
-	struct subscriber_list_s *prev;
-} subscriber_list_t;
-
-typedef struct topic_map_s {
-	char *topic;
-	subscriber_list_t *subscribers;
+	uint32_t state; // Priority and SUB_* flags, changed atomically
+} subscriber_entry_t;
+
+/*
+ * Subscribers of a topic. Readers scan the first count entries skipping the removed ones. Under the shard lock,
+ * writers append entries, mark them removed or revive them in place, so a subscriber has a single entry and can't
+ * be seen twice by a publish. The array is only replaced to grow it or to drop the removed entries.
+ */
+typedef struct subscriber_array_s {
+	uint32_t count;
+	uint32_t size;
+	uint32_t live; // Entries not removed
+	uint32_t mask; // Of index
+	// Only used by writers
+	struct subscriptions_list_s **links; // Node of each entry in the subscriptions list of its subscriber
+	uint32_t *index;                     // Hash of the entries by subscriber (entry + 1, 0 if free)
+	subscriber_entry_t entries[];
+} subscriber_array_t;
+
+struct topic_shard_s;
+struct topic_table_s;
+
+// Refcounted full topic path, shared by a topic handle and the messages created through it
+typedef struct topic_name_s {
+	uint32_t ref;
+	uint32_t len;
+	char str[];
+} topic_name_t;
+
+// Node of the topic tree. Each node is one dot separated segment of the topic path.
+// The node is also the handle returned by ps_topic_get(), nodes with handles are never pruned.
+typedef struct ps_topic_s {
+	struct ps_topic_s *parent;
+	struct topic_shard_s *shard; // Shard whose lock protects this node
+	struct topic_table_s *children;
+	subscriber_array_t *subscribers;
 	ps_msg_t *sticky;
-	UT_hash_handle hh;
+	topic_name_t *name;                 // Full path, set by ps_topic_get() and for subscribed long topics
+	struct ps_topic_s *next[2];         // Bucket chain in the parent table, one link per table generation
+	struct ps_topic_s *sticky_children; // Children whose subtree holds sticky messages
+	struct ps_topic_s *sticky_link[2];  // Previous and next node in the sticky children of the parent
+	uint32_t refs;                      // Handles held on this node
+	uint32_t stickies;                  // Sticky messages in the subtree, its own included. Not kept for roots.
+	uint32_t hashv;
+	size_t len;
+	char segment[];
 } topic_map_t;
 
+typedef struct topic_table_s {
+	uint32_t gen;
+	uint32_t mask;
+	size_t count;
+	topic_map_t *buckets[];
+} topic_table_t;
+
 typedef struct subscriptions_list_s {
 	topic_map_t *tm;
 	struct subscriptions_list_s *next;
@@ -37,34 +91,732 @@ typedef struct subscriptions_list_s {
 struct ps_subscriber_s {
 	ps_queue_t *q;
 	subscriptions_list_t *subs;
+	mutex_t mux; // Protects subs
 	uint32_t overflow;
 	ps_new_msg_cb_t new_msg_cb;
 	ps_non_empty_cb_t non_empty_cb;
 	void *userData;
+	int fd;           // Readiness eventfd, -1 until requested
+	uint32_t refs;    // The owner plus the pending callback notifications
+	uint32_t running; // Callbacks being run
+	bool closed;      // Freed by its owner, no more callbacks
+	ps_dispatcher_t *dispatcher;
+	ps_handler_t handler;
+	uint32_t sched;                                   // SCHED_* state in the dispatcher
+	uint32_t batched;                                 // Deliveries pending in publish batches
+	ps_subscriber_t *dprev, *dnext;                   // In the subscribers of its dispatcher
+	void (*spill)(ps_subscriber_t *su, ps_msg_t *msg); // Internal, takes the messages its full queue rejects
 };
 
-static mutex_t lock;
+// Shards split the first level of the topic tree, so every subtree below it belongs to a single shard.
+typedef struct topic_shard_s {
+	mutex_t lock;
+	topic_table_t *table;
+	topic_map_t *sticky_children; // Sticky children of the root in this shard
+} __attribute__((aligned(64))) topic_shard_t;
+
+#define TOPIC_TABLE_MIN_SIZE 4
+#define SUBSCRIBERS_MIN_SIZE 4
+#define SUBSCRIBERS_PREFETCH 4 // Subscribers fetched ahead while publishing
+#define RCU_STRIPES 16
+#define RCU_RETIRE_MAX 256
+
+#define MSG_FL_TOPIC_NAME 0x01   // msg->topic points into a shared topic_name_t
+#define MSG_FL_POOLED 0x02       // Allocated from the message pool
+#define MSG_FL_TOPIC_INLINE 0x04 // msg->topic points into the message allocation
+
+#define MSG_TOPIC_INLINE 48 // Topics up to this length (with the terminator) are stored in the message
+
+#define MSG_CACHE_MAX 256   // Free messages kept by each thread
+#define MSG_REMOTE_BATCH 32 // Messages handed back at once to the thread that allocated them
 
-static topic_map_t *topic_map = NULL;
+typedef uint32_t rcu_token_t;
+
+// Visitor of the topics a message is delivered to, returns the number of deliveries
+typedef size_t (*topic_fn_t)(topic_map_t *, void *);
+
+static topic_map_t *topic_root = NULL;
+static topic_shard_t *topic_map = NULL;
+static size_t topic_map_shards;
+
+// Wildcard subscriptions live in their own tree, whose segments may be "*" (any segment) or "#" (any tail)
+static topic_map_t *wildcard_root = NULL;
+static topic_shard_t wildcard_shard;
+static uint32_t wildcard_any_hash;
+static uint32_t wildcard_tail_hash;
 
 static uint32_t uuid_ctr;
 
+#define CALL_QUEUE_SIZE 16 // Room for late replies of calls that timed out
+
+// Reply subscriber of a thread for ps_call, subscribed to its rtopic "$r.<id>". Each call gets the next seq as
+// call_id, the replies carry it back and it tells them apart from late replies of earlier calls.
+typedef struct call_chan_s {
+	struct call_chan_s *next;
+	ps_subscriber_t *su;
+	uint32_t seq;
+	bool busy;         // A call is waiting on it, nested calls (from callbacks) use a temporary channel
+	size_t queue_size; // Grown for the replies of ps_call_all
+	char rtopic[16];
+} call_chan_t;
+
+#define CALL_SERVICE_QUEUE_SIZE 4096 // Replies to asynchronous calls waiting for the call thread
+#define CALL_SERVICE_BATCH 64
+
+// Asynchronous call in flight, in a slot of the call service
+typedef struct pending_call_s {
+	uint32_t seq;  // Call id, 0 if the slot is free
+	uint32_t heap; // Position in the deadline heap, UINT32_MAX without deadline
+	int64_t deadline;
+	ps_call_cb_t cb;
+	void *ctx;
+} pending_call_t;
+
+// Runs the callbacks of the asynchronous calls of all threads from a single thread, with a single reply subscriber
+// on "$r.<id>". The call id of a call picks its slot (the low bits) and the timeouts are kept in a heap of slots
+// ordered by deadline. The replies that don't fit in the queue are spilled to a list, so none is lost.
+typedef struct call_service_s {
+	mutex_t lock;
+	semaphore_t wake; // Posted when the queue gets messages, on spills and on earlier deadlines
+	ps_subscriber_t *su;
+	ps_msg_t **spilled;
+	size_t spilled_count;
+	size_t spilled_size;
+	thread_t thread;
+	bool stop;
+	int64_t wait_until; // Deadline the thread sleeps until, INT64_MIN while it is awake
+	uint32_t seq;
+	pending_call_t *slots;
+	uint32_t nslots; // Power of 2
+	uint32_t count;  // Calls in flight
+	uint32_t *heap;
+	uint32_t heap_count;
+	char rtopic[16];
+} call_service_t;
+
+static mutex_t calls_lock;
+static call_chan_t *call_chans;    // Channels of all threads, freed when their thread exits or by ps_deinit
+static thread_key_t call_chan_key; // Frees the channel of a thread when it exits
+static uint32_t call_chan_gen;     // Invalidates the thread channels of a previous ps_init
+static _Thread_local call_chan_t *call_chan;
+static _Thread_local uint32_t call_chan_gen_local;
+static call_service_t *call_service;
+static void call_chan_exit(void *v);
+static void calls_free(void);
+
 static uint32_t stat_live_msg;
 static uint32_t stat_live_subscribers;
 
-#define GLOBAL_LOCK mutex_lock(lock);
-#define GLOBAL_UNLOCK mutex_unlock(lock);
+// Every message is allocated with room for a short topic after it
+typedef struct msg_body_s {
+	ps_msg_t msg;
+	char topic[MSG_TOPIC_INLINE];
+} msg_body_t;
+
+/*
+ * Message pool. Each thread allocates from its own cache of free messages. Messages freed by another thread
+ * (usually a consumer) are gathered in batches per owner cache and pushed to its remote list with a single CAS;
+ * the owner takes the whole remote list when its local one runs out. A cache is closed when its thread exits or by
+ * ps_deinit: its free messages are released and its remote list is marked closed, so the messages still in use are
+ * freed when they come back. Each of them holds a reference to the cache, the last one frees it.
+ */
+typedef struct msg_block_s {
+	msg_body_t body;
+	struct msg_block_s *next;
+	struct msg_cache_s *owner;
+} msg_block_t;
+
+typedef struct msg_cache_s {
+	msg_block_t *local;
+	size_t local_count;
+	// Messages of another cache freed by this thread
+	struct msg_cache_s *batch_owner;
+	msg_block_t *batch_head;
+	msg_block_t *batch_tail;
+	size_t batch_count;
+	struct msg_cache_s *next; // All the caches
+	msg_block_t *remote __attribute__((aligned(64))); // Returned by other threads, MSG_REMOTE_CLOSED once closed
+	uint32_t remote_count;
+	uint32_t refs; // Its thread plus the messages it allocated
+} msg_cache_t;
+
+#define MSG_REMOTE_CLOSED ((msg_block_t *) 1)
+
+static bool msg_pool;
+static uint32_t msg_pool_gen; // Invalidates the thread caches of a previous ps_init
+static msg_cache_t *msg_caches;
+static mutex_t msg_caches_lock;
+static thread_key_t msg_cache_key; // Closes the cache of a thread when it exits
+static _Thread_local msg_cache_t *msg_cache;
+static _Thread_local uint32_t msg_cache_gen;
+
+/*
+ * Epoch based read side for the topic tree and the subscriber snapshots.
+ *
+ * Readers (ps_publish, ps_subs_count) never block: they register in one of two
+ * reader counters selected by the current epoch. Writers serialize on the shard
+ * locks, publish new versions with release stores and retire the old ones. Retired
+ * memory is freed by rcu_synchronize() once every reader of the previous epoch has
+ * left its read section. Counters are striped per thread to avoid cache line
+ * ping-pong between publishers.
+ */
+static struct {
+	uint32_t n;
+} __attribute__((aligned(64))) rcu_readers[2][RCU_STRIPES];
+static uint32_t rcu_epoch;
+static uint32_t rcu_stripe_ctr;
+static _Thread_local uint32_t rcu_stripe = UINT32_MAX;
+static mutex_t rcu_lock;
+static void **rcu_retired;
+static size_t rcu_retired_count;
+static size_t rcu_retired_size;
+
+static rcu_token_t rcu_read_lock(void) {
+	if (rcu_stripe == UINT32_MAX) {
+		rcu_stripe = __atomic_fetch_add(&rcu_stripe_ctr, 1, __ATOMIC_RELAXED) % RCU_STRIPES;
+	}
+	for (;;) {
+		uint32_t e = __atomic_load_n(&rcu_epoch, __ATOMIC_SEQ_CST) & 1;
+		__atomic_add_fetch(&rcu_readers[e][rcu_stripe].n, 1, __ATOMIC_SEQ_CST);
+		if ((__atomic_load_n(&rcu_epoch, __ATOMIC_SEQ_CST) & 1) == e) {
+			return e | (rcu_stripe << 1);
+		}
+		// A writer flipped the epoch meanwhile, register again in the new one
+		__atomic_sub_fetch(&rcu_readers[e][rcu_stripe].n, 1, __ATOMIC_SEQ_CST);
+	}
+}
+
+static void rcu_read_unlock(rcu_token_t token) {
+	__atomic_sub_fetch(&rcu_readers[token & 1][token >> 1].n, 1, __ATOMIC_RELEASE);
+}
+
+static void rcu_wait_readers(void) {
+	uint32_t e = __atomic_fetch_add(&rcu_epoch, 1, __ATOMIC_SEQ_CST) & 1;
+	for (size_t i = 0; i < RCU_STRIPES; i++) {
+		while (__atomic_load_n(&rcu_readers[e][i].n, __ATOMIC_SEQ_CST) != 0) {
+			thread_yield();
+		}
+	}
+}
+
+static void topic_name_unref(topic_name_t *name);
+
+// Retired pointers with the low bit set are topic names, to be unreferenced instead of freed
+static void rcu_free_retired(void) {
+	for (size_t i = 0; i < rcu_retired_count; i++) {
+		uintptr_t p = (uintptr_t) rcu_retired[i];
+		if (p & 1) {
+			topic_name_unref((topic_name_t *) (p & ~(uintptr_t) 1));
+		} else {
+			free(rcu_retired[i]);
+		}
+	}
+	rcu_retired_count = 0;
+}
+
+// Waits until no reader can reference memory unpublished before the call. Must not be called from a read section.
+static void rcu_synchronize(void) {
+	mutex_lock(rcu_lock);
+	rcu_wait_readers();
+	rcu_free_retired();
+	mutex_unlock(rcu_lock);
+}
+
+// Frees ptr once all current readers are gone. Must not be called from a read section.
+static void rcu_retire(void *ptr) {
+	if (ptr == NULL)
+		return;
+	mutex_lock(rcu_lock);
+	if (rcu_retired_count == rcu_retired_size) {
+		rcu_retired_size = rcu_retired_size ? rcu_retired_size * 2 : RCU_RETIRE_MAX;
+		rcu_retired = realloc(rcu_retired, rcu_retired_size * sizeof(void *));
+	}
+	rcu_retired[rcu_retired_count++] = ptr;
+	if (rcu_retired_count >= RCU_RETIRE_MAX) {
+		rcu_wait_readers();
+		rcu_free_retired();
+	}
+	mutex_unlock(rcu_lock);
+}
+
+static topic_table_t *topic_table_new(uint32_t size, uint32_t gen) {
+	topic_table_t *tt = calloc(1, sizeof(topic_table_t) + size * sizeof(topic_map_t *));
+	tt->gen = gen;
+	tt->mask = size - 1;
+	return tt;
+}
+
+/*
+ * Hashes the topic segment starting at seg (FNV-1a) while looking for its end, so walking a
+ * topic scans it only once. Returns the end of the segment: a dot, the flags space or the NUL.
+ */
+static const char *topic_segment(const char *seg, uint32_t *hashv) {
+	uint32_t h = 2166136261u;
+	for (; *seg != '\0' && *seg != '.' && *seg != ' '; seg++) {
+		h = (h ^ (uint8_t) *seg) * 16777619u;
+	}
+	*hashv = h;
+	return seg;
+}
+
+static topic_map_t *topic_table_first(topic_table_t *tt, size_t idx) {
+	return __atomic_load_n(&tt->buckets[idx], __ATOMIC_ACQUIRE);
+}
+
+static topic_map_t *topic_table_next(topic_table_t *tt, topic_map_t *tm) {
+	return __atomic_load_n(&tm->next[tt->gen], __ATOMIC_ACQUIRE);
+}
+
+#define TOPIC_TABLE_FOREACH(tt, idx, tm, tmp)                                                                          \
+	for (idx = 0; idx <= (tt)->mask; idx++)                                                                            \
+		for (tm = topic_table_first(tt, idx); tm != NULL && (tmp = topic_table_next(tt, tm), 1); tm = tmp)
+
+static topic_shard_t *topic_shard(uint32_t hashv) {
+	return &topic_map[((uint64_t) hashv * topic_map_shards) >> 32];
+}
+
+static void lock_all_shards(void) {
+	for (size_t i = 0; i < topic_map_shards; i++) {
+		mutex_lock(topic_map[i].lock);
+	}
+}
+
+static void unlock_all_shards(void) {
+	for (size_t i = topic_map_shards; i > 0; i--) {
+		mutex_unlock(topic_map[i - 1].lock);
+	}
+}
+
+static void topic_table_grow(topic_table_t **ttp) {
+	topic_table_t *old = *ttp;
+	topic_table_t *tt = topic_table_new((old->mask + 1) * 2, !old->gen);
+	topic_map_t *tm, *tmp;
+	size_t idx;
+
+	// The links of the new generation may still be walked by readers of the table before the old one.
+	rcu_synchronize();
+	TOPIC_TABLE_FOREACH(old, idx, tm, tmp) {
+		topic_map_t **bucket = &tt->buckets[tm->hashv & tt->mask];
+		tm->next[tt->gen] = *bucket;
+		*bucket = tm;
+	}
+	tt->count = old->count;
+	__atomic_store_n(ttp, tt, __ATOMIC_RELEASE);
+	rcu_retire(old);
+}
+
+static void topic_table_add(topic_table_t **ttp, topic_map_t *tm) {
+	if (*ttp == NULL) {
+		__atomic_store_n(ttp, topic_table_new(TOPIC_TABLE_MIN_SIZE, 0), __ATOMIC_RELEASE);
+	} else if ((*ttp)->count >= (*ttp)->mask + 1) {
+		topic_table_grow(ttp);
+	}
+	topic_table_t *tt = *ttp;
+	topic_map_t **bucket = &tt->buckets[tm->hashv & tt->mask];
+	tm->next[tt->gen] = *bucket;
+	__atomic_store_n(bucket, tm, __ATOMIC_RELEASE);
+	tt->count++;
+}
+
+static void topic_table_del(topic_table_t *tt, topic_map_t *tm) {
+	topic_map_t **link = &tt->buckets[tm->hashv & tt->mask];
+	while (*link != tm) {
+		link = &(*link)->next[tt->gen];
+	}
+	// Readers standing on tm can still follow its link until it is freed
+	__atomic_store_n(link, tm->next[tt->gen], __ATOMIC_RELEASE);
+	tt->count--;
+}
+
+// Table holding the children of parent with the given segment hash
+static topic_table_t **topic_children(topic_map_t *parent, uint32_t hashv) {
+	if (parent == topic_root) {
+		return &topic_shard(hashv)->table;
+	}
+	return &parent->children;
+}
+
+static topic_map_t **topic_sticky_children(topic_map_t *parent, uint32_t hashv) {
+	if (parent == topic_root) {
+		return &topic_shard(hashv)->sticky_children;
+	}
+	return &parent->sticky_children;
+}
+
+static topic_map_t *topic_new(topic_map_t *parent, const char *segment, size_t len, uint32_t hashv) {
+	topic_map_t *tm = calloc(1, sizeof(*tm) + len + 1);
+	memcpy(tm->segment, segment, len);
+	tm->len = len;
+	tm->hashv = hashv;
+	tm->parent = parent;
+	if (parent == topic_root) {
+		tm->shard = topic_shard(hashv);
+	} else if (parent != NULL) {
+		tm->shard = parent->shard;
+	}
+	return tm;
+}
+
+static topic_name_t *topic_name_new(const char *topic, size_t len) {
+	topic_name_t *name = malloc(sizeof(*name) + len + 1);
+	name->ref = 1;
+	name->len = len;
+	memcpy(name->str, topic, len);
+	name->str[len] = '\0';
+	return name;
+}
+
+static topic_name_t *topic_name_of(const char *str) {
+	return (topic_name_t *) (str - offsetof(topic_name_t, str));
+}
+
+static void topic_name_unref(topic_name_t *name) {
+	if (name != NULL && __sync_sub_and_fetch(&name->ref, 1) == 0) {
+		free(name);
+	}
+}
+
+static void topic_free_tree(topic_map_t *tm) {
+	topic_map_t *child, *tmp;
+	size_t idx;
+
+	if (tm->children != NULL) {
+		TOPIC_TABLE_FOREACH(tm->children, idx, child, tmp) {
+			topic_free_tree(child);
+		}
+		free(tm->children);
+	}
+	ps_unref_msg(tm->sticky);
+	topic_name_unref(tm->name);
+	free(tm->subscribers);
+	free(tm);
+}
+
+static void msg_cache_exit(void *v);
+
+static msg_cache_t *msg_cache_get(void) {
+	uint32_t gen = __atomic_load_n(&msg_pool_gen, __ATOMIC_ACQUIRE);
+	if (msg_cache == NULL || msg_cache_gen != gen) {
+		msg_cache_t *c = aligned_alloc(64, sizeof(msg_cache_t));
+		memset(c, 0, sizeof(msg_cache_t));
+		c->refs = 1;
+		mutex_lock(msg_caches_lock);
+		c->next = msg_caches;
+		msg_caches = c;
+		mutex_unlock(msg_caches_lock);
+		if (msg_cache_key != NULL) {
+			thread_key_set(msg_cache_key, c);
+		}
+		msg_cache = c;
+		msg_cache_gen = gen;
+	}
+	return msg_cache;
+}
+
+static void msg_cache_unref(msg_cache_t *c) {
+	if (__atomic_sub_fetch(&c->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		free(c);
+	}
+}
+
+static void msg_block_free(msg_block_t *b) {
+	msg_cache_t *owner = b->owner;
+	free(b);
+	msg_cache_unref(owner);
+}
+
+static void msg_blocks_free(msg_block_t *b) {
+	while (b != NULL) {
+		msg_block_t *next = b->next;
+		msg_block_free(b);
+		b = next;
+	}
+}
+
+static void msg_batch_flush(msg_cache_t *c) {
+	if (c->batch_count == 0)
+		return;
+	msg_cache_t *owner = c->batch_owner;
+	msg_block_t *batch = c->batch_head;
+	uint32_t count = c->batch_count;
+	msg_block_t *head = __atomic_load_n(&owner->remote, __ATOMIC_RELAXED);
+	do {
+		c->batch_tail->next = head;
+	} while (head != MSG_REMOTE_CLOSED && !__atomic_compare_exchange_n(&owner->remote, &head, batch, true,
+	                                                                   __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	if (head == MSG_REMOTE_CLOSED) {
+		c->batch_tail->next = NULL;
+		msg_blocks_free(batch);
+	} else {
+		__atomic_add_fetch(&owner->remote_count, count, __ATOMIC_RELAXED);
+	}
+	c->batch_owner = NULL;
+	c->batch_head = c->batch_tail = NULL;
+	c->batch_count = 0;
+}
+
+static ps_msg_t *msg_alloc(void) {
+	if (!msg_pool) {
+		ps_msg_t *msg = malloc(sizeof(msg_body_t));
+		memset(msg, 0, sizeof(ps_msg_t));
+		return msg;
+	}
+
+	msg_cache_t *c = msg_cache_get();
+	if (c->local == NULL && __atomic_load_n(&c->remote, __ATOMIC_RELAXED) != NULL) {
+		c->local = __atomic_exchange_n(&c->remote, NULL, __ATOMIC_ACQUIRE);
+		for (msg_block_t *b = c->local; b != NULL; b = b->next) {
+			c->local_count++;
+		}
+		__atomic_sub_fetch(&c->remote_count, c->local_count, __ATOMIC_RELAXED);
+	}
+	msg_block_t *b = c->local;
+	if (b != NULL) {
+		c->local = b->next;
+		c->local_count--;
+	} else {
+		b = malloc(sizeof(msg_block_t));
+		b->owner = c;
+		__atomic_add_fetch(&c->refs, 1, __ATOMIC_RELAXED);
+	}
+	memset(&b->body.msg, 0, sizeof(ps_msg_t));
+	b->body.msg._fl = MSG_FL_POOLED;
+	return &b->body.msg;
+}
+
+static void msg_release(ps_msg_t *msg) {
+	if (!(msg->_fl & MSG_FL_POOLED)) {
+		free(msg);
+		return;
+	}
+	msg_block_t *b = (msg_block_t *) msg;
+	if (!msg_pool) { // Released after ps_deinit
+		msg_block_free(b);
+		return;
+	}
+	msg_cache_t *c = msg_cache_get();
+	if (b->owner == c) {
+		if (c->local_count >= MSG_CACHE_MAX) {
+			msg_block_free(b);
+			return;
+		}
+		b->next = c->local;
+		c->local = b;
+		c->local_count++;
+		return;
+	}
+	if (c->batch_owner != b->owner) {
+		msg_batch_flush(c);
+	}
+	// An owner that stopped allocating doesn't take them back
+	if (__atomic_load_n(&b->owner->remote_count, __ATOMIC_RELAXED) >= MSG_CACHE_MAX * 4) {
+		msg_block_free(b);
+		return;
+	}
+	b->next = c->batch_head;
+	c->batch_head = b;
+	if (c->batch_tail == NULL)
+		c->batch_tail = b;
+	c->batch_owner = b->owner;
+	if (++c->batch_count == MSG_REMOTE_BATCH)
+		msg_batch_flush(c);
+}
+
+// Releases the free messages of a cache whose thread is gone, the cache goes away with the last message in use
+static void msg_cache_close(msg_cache_t *c) {
+	msg_batch_flush(c);
+	msg_blocks_free(c->local);
+	c->local = NULL;
+	c->local_count = 0;
+	msg_blocks_free(__atomic_exchange_n(&c->remote, MSG_REMOTE_CLOSED, __ATOMIC_ACQUIRE));
+	msg_cache_unref(c);
+}
+
+static void msg_cache_exit(void *v) {
+	msg_cache_t *c = v;
+	mutex_lock(msg_caches_lock);
+	for (msg_cache_t **p = &msg_caches; *p != NULL; p = &(*p)->next) {
+		if (*p == c) {
+			*p = c->next;
+			break;
+		}
+	}
+	mutex_unlock(msg_caches_lock);
+	if (msg_cache == c) {
+		msg_cache = NULL; // Messages released by later destructors of this thread get a new cache
+	}
+	msg_cache_close(c);
+}
+
+static void msg_pool_free(void) {
+	thread_key_destroy(&msg_cache_key);
+	while (msg_caches != NULL) {
+		msg_cache_t *c = msg_caches;
+		msg_caches = c->next;
+		msg_cache_close(c);
+	}
+	__atomic_add_fetch(&msg_pool_gen, 1, __ATOMIC_RELEASE);
+	msg_pool = false;
+}
 
 void ps_init(void) {
-	mutex_init(&lock);
+	ps_init_opts(NULL);
+}
+
+void ps_init_opts(const ps_opts_t *opts) {
+	size_t shards = PS_TOPIC_SHARDS;
+	if (opts != NULL && opts->shards > 0) {
+		shards = opts->shards;
+	}
+	msg_pool = opts != NULL && opts->msg_pool;
+	mutex_init(&msg_caches_lock);
+	thread_key_init(&msg_cache_key, msg_cache_exit);
+	mutex_init(&calls_lock);
+	thread_key_init(&call_chan_key, call_chan_exit);
+	mutex_init(&rcu_lock);
+	topic_map_shards = shards;
+	topic_map = calloc(shards, sizeof(topic_shard_t));
+	for (size_t i = 0; i < shards; i++) {
+		mutex_init(&topic_map[i].lock);
+	}
+	uint32_t hashv;
+	topic_segment("", &hashv);
+	topic_root = topic_new(NULL, "", 0, hashv);
+	topic_root->shard = topic_shard(topic_root->hashv);
+
+	mutex_init(&wildcard_shard.lock);
+	wildcard_root = topic_new(NULL, "", 0, hashv);
+	wildcard_root->shard = &wildcard_shard;
+	topic_segment("*", &wildcard_any_hash);
+	topic_segment("#", &wildcard_tail_hash);
 }
 
 void ps_deinit(void) {
-	mutex_destroy(&lock);
+	topic_map_t *tm, *tm_tmp;
+	size_t idx;
+
+	thread_key_destroy(&call_chan_key);
+	calls_free();
+	rcu_synchronize();
+	for (size_t i = 0; i < topic_map_shards; i++) {
+		if (topic_map[i].table != NULL) {
+			TOPIC_TABLE_FOREACH(topic_map[i].table, idx, tm, tm_tmp) {
+				topic_free_tree(tm);
+			}
+			free(topic_map[i].table);
+		}
+		mutex_destroy(&topic_map[i].lock);
+	}
+	topic_free_tree(topic_root);
+	topic_root = NULL;
+	topic_free_tree(wildcard_root);
+	wildcard_root = NULL;
+	mutex_destroy(&wildcard_shard.lock);
+	free(topic_map);
+	topic_map = NULL;
+	topic_map_shards = 0;
+	free(rcu_retired);
+	rcu_retired = NULL;
+	rcu_retired_size = 0;
+	mutex_destroy(&rcu_lock);
+	msg_pool_free();
+	mutex_destroy(&msg_caches_lock);
+	mutex_destroy(&calls_lock);
+}
+
+static void ps_msg_free_topic(ps_msg_t *msg) {
+	if (msg->_fl & MSG_FL_TOPIC_NAME) {
+		topic_name_unref(topic_name_of(msg->topic));
+	} else if (!(msg->_fl & MSG_FL_TOPIC_INLINE)) {
+		free(msg->topic);
+	}
+	msg->_fl &= ~(MSG_FL_TOPIC_NAME | MSG_FL_TOPIC_INLINE);
+	msg->topic = NULL;
+	msg->_topic_len = 0;
+}
+
+static void ps_msg_share_topic(ps_msg_t *msg, topic_name_t *name) {
+	msg->topic = name->str;
+	msg->_topic_len = name->len < UINT16_MAX ? name->len : UINT16_MAX;
+	msg->_fl |= MSG_FL_TOPIC_NAME;
+}
+
+// Short topics are copied into the message allocation, long ones get their own
+static void ps_msg_store_topic(ps_msg_t *msg, const char *topic, size_t len) {
+	if (len < MSG_TOPIC_INLINE) {
+		char *str = ((msg_body_t *) msg)->topic;
+		memcpy(str, topic, len);
+		str[len] = '\0';
+		msg->topic = str;
+		msg->_topic_len = len;
+		msg->_fl |= MSG_FL_TOPIC_INLINE;
+		return;
+	}
+	msg->topic = malloc(len + 1);
+	memcpy(msg->topic, topic, len);
+	msg->topic[len] = '\0';
+	msg->_topic_len = len < UINT16_MAX ? len : UINT16_MAX;
+}
+
+// Long topics share the name of their node when it has one, tm is the result of walking topic. Must be called from a
+// read section. Walking the tree only for this costs more than the copy, so it is done where the walk is needed anyway.
+static void ps_msg_store_walked_topic(ps_msg_t *msg, const char *topic, size_t len, topic_map_t *tm, bool exact) {
+	topic_name_t *name = exact ? __atomic_load_n(&tm->name, __ATOMIC_ACQUIRE) : NULL;
+	if (len >= MSG_TOPIC_INLINE && name != NULL && name->len == len) {
+		__sync_add_and_fetch(&name->ref, 1);
+		ps_msg_share_topic(msg, name);
+	} else {
+		ps_msg_store_topic(msg, topic, len);
+	}
+}
+
+static size_t ps_msg_topic_len(const ps_msg_t *msg) {
+	return msg->_topic_len < UINT16_MAX ? msg->_topic_len : strlen(msg->topic);
+}
+
+// String and buffer payload referenced by a message and its duplicates
+typedef struct msg_payload_s {
+	uint32_t ref;
+	void *ptr;
+	ps_dtor_t dtor;
+} msg_payload_t;
+
+static void msg_payload_unref(msg_payload_t *p) {
+	if (__sync_sub_and_fetch(&p->ref, 1) == 0) {
+		p->dtor(p->ptr);
+		free(p);
+	}
+}
+
+// Returns a new reference to the payload of msg, moving it to a shared block on the first duplicate
+static msg_payload_t *ps_msg_share_value(ps_msg_t *msg) {
+	msg_payload_t *p = __atomic_load_n(&msg->_payload, __ATOMIC_ACQUIRE);
+	if (p == NULL) {
+		p = malloc(sizeof(msg_payload_t));
+		p->ref = 1;
+		if (PS_IS_STR(msg)) {
+			p->ptr = msg->str_val;
+			p->dtor = free;
+		} else {
+			p->ptr = msg->buf_val.ptr;
+			p->dtor = msg->buf_val.dtor;
+		}
+		// The original may be duplicated by several threads at once
+		msg_payload_t *cur = NULL;
+		if (!__atomic_compare_exchange_n(&msg->_payload, &cur, p, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			free(p);
+			p = cur;
+		}
+	}
+	__sync_add_and_fetch(&p->ref, 1);
+	return p;
 }
 
 static void ps_msg_free_value(ps_msg_t *msg) {
-	if (PS_IS_STR(msg)) {
+	if (msg->_payload != NULL) {
+		msg_payload_unref(msg->_payload);
+		msg->_payload = NULL;
+	} else if (PS_IS_STR(msg)) {
 		free(msg->str_val);
 	} else if (PS_IS_BUF(msg)) {
 		if (msg->buf_val.ptr && msg->buf_val.dtor) {
@@ -101,47 +853,75 @@ static void ps_msg_set_vvalue(ps_msg_t *msg, uint32_t flags, va_list args) {
 	}
 }
 
-ps_msg_t *ps_new_msg(const char *topic, uint32_t flags, ...) {
-	if (topic == NULL)
-		return NULL;
-
-	ps_msg_t *msg = calloc(1, sizeof(ps_msg_t));
+static ps_msg_t *ps_new_vmsg(uint32_t flags, va_list args) {
+	ps_msg_t *msg = msg_alloc();
 
 	msg->_ref = 1;
 	msg->flags = flags;
-	msg->topic = strdup(topic);
 	msg->rtopic = NULL;
 	msg->priority = 0;
 
+	ps_msg_set_vvalue(msg, flags, args);
+
+	__sync_add_and_fetch(&stat_live_msg, 1);
+	return msg;
+}
+
+ps_msg_t *ps_new_msg(const char *topic, uint32_t flags, ...) {
+	if (topic == NULL)
+		return NULL;
+
 	va_list args;
 	va_start(args, flags);
 
-	ps_msg_set_vvalue(msg, flags, args);
+	ps_msg_t *msg = ps_new_vmsg(flags, args);
 
 	va_end(args);
 
-	__sync_add_and_fetch(&stat_live_msg, 1);
+	ps_msg_store_topic(msg, topic, strlen(topic));
+	return msg;
+}
+
+ps_msg_t *ps_new_msg_to(ps_topic_t *topic, uint32_t flags, ...) {
+	if (topic == NULL)
+		return NULL;
+
+	va_list args;
+	va_start(args, flags);
+
+	ps_msg_t *msg = ps_new_vmsg(flags, args);
+
+	va_end(args);
+
+	// The handle keeps the name alive, the message takes its own reference instead of copying it
+	__sync_add_and_fetch(&topic->name->ref, 1);
+	ps_msg_share_topic(msg, topic->name);
 	return msg;
 }
 
 ps_msg_t *ps_dup_msg(ps_msg_t const *msg_orig) {
 
-	ps_msg_t *msg = malloc(sizeof(ps_msg_t));
+	ps_msg_t *msg = msg_alloc();
+	uint8_t fl = msg->_fl;
 	memcpy(msg, msg_orig, sizeof(ps_msg_t));
+	msg->_fl = (msg_orig->_fl & ~(MSG_FL_POOLED | MSG_FL_TOPIC_INLINE)) | fl;
 	msg->_ref = 1;
 	msg->priority = msg_orig->priority;
-	if (msg_orig->topic != NULL) {
-		msg->topic = strdup(msg_orig->topic);
+	if (msg_orig->_fl & MSG_FL_TOPIC_NAME) {
+		__sync_add_and_fetch(&topic_name_of(msg_orig->topic)->ref, 1);
+	} else if (msg_orig->topic != NULL) {
+		ps_msg_store_topic(msg, msg_orig->topic, ps_msg_topic_len(msg_orig));
 	}
 	if (msg_orig->rtopic != NULL) {
 		msg->rtopic = strdup(msg_orig->rtopic);
 	}
 
-	if (PS_IS_STR(msg_orig)) {
-		if (msg_orig->str_val != NULL) {
-			msg->str_val = strdup(msg_orig->str_val);
-		}
+	msg->_payload = NULL;
+	if (msg_orig->_payload != NULL || (PS_IS_STR(msg_orig) && msg_orig->str_val != NULL) ||
+	    (PS_IS_BUF(msg_orig) && msg_orig->buf_val.ptr != NULL && msg_orig->buf_val.dtor != NULL)) {
+		msg->_payload = ps_msg_share_value((ps_msg_t *) msg_orig);
 	} else if (PS_IS_BUF(msg_orig)) {
+		// Not owned by the message, it may not outlive it
 		msg->buf_val.ptr = malloc(msg_orig->buf_val.sz);
 		memcpy(msg->buf_val.ptr, msg_orig->buf_val.ptr, msg_orig->buf_val.sz);
 		msg->buf_val.dtor = free;
@@ -155,12 +935,9 @@ ps_msg_t *ps_dup_msg(ps_msg_t const *msg_orig) {
 }
 
 void ps_msg_set_topic(ps_msg_t *msg, const char *topic) {
-	if (msg->topic != NULL) {
-		free(msg->topic); // Free previous topic
-		msg->topic = NULL;
-	}
+	ps_msg_free_topic(msg); // Free previous topic
 	if (topic != NULL) {
-		msg->topic = strdup(topic);
+		ps_msg_store_topic(msg, topic, strlen(topic));
 	}
 }
 
@@ -223,13 +1000,13 @@ void ps_unref_msg(ps_msg_t *msg) {
 	if (msg == NULL)
 		return;
 	if (__sync_sub_and_fetch(&msg->_ref, 1) == 0) {
-		free(msg->topic);
+		ps_msg_free_topic(msg);
 		if (msg->rtopic != NULL) {
 			free(msg->rtopic);
 		}
 		ps_msg_free_value(msg);
 
-		free(msg);
+		msg_release(msg);
 		__sync_sub_and_fetch(&stat_live_msg, 1);
 	}
 }
@@ -238,88 +1015,502 @@ int ps_stats_live_msg(void) {
 	return __sync_fetch_and_add(&stat_live_msg, 0);
 }
 
-static int free_topic_if_empty(topic_map_t *tm) {
-	if (tm->subscribers == NULL && tm->sticky == NULL) {
-		HASH_DEL(topic_map, tm);
-		free(tm->topic);
-		free(tm);
-		return 1;
-	}
-	return 0;
+static bool topic_is_empty(topic_map_t *tm) {
+	return tm->refs == 0 && tm->subscribers == NULL && tm->sticky == NULL &&
+	       (tm->children == NULL || tm->children->count == 0);
 }
 
-static topic_map_t *create_topic(const char *topic) {
-	topic_map_t *tm = NULL;
-	tm = calloc(1, sizeof(*tm));
-	tm->topic = strdup(topic);
-	HASH_ADD_KEYPTR(hh, topic_map, tm->topic, strlen(tm->topic), tm);
-	return tm;
+// Adds delta to the sticky count of tm and its ancestors, linking the subtrees that start or stop holding sticky
+// messages in the sticky children of their parent. The whole chain is in the shard of tm, except for the root which
+// spans all of them and isn't counted. The shard lock of tm must be held.
+static void topic_count_sticky(topic_map_t *tm, int delta) {
+	for (; tm != NULL && tm->parent != NULL; tm = tm->parent) {
+		topic_map_t **head = topic_sticky_children(tm->parent, tm->hashv);
+		if (tm->stickies == 0) {
+			DL_APPEND2(*head, tm, sticky_link[0], sticky_link[1]);
+		}
+		tm->stickies += delta;
+		if (tm->stickies == 0) {
+			DL_DELETE2(*head, tm, sticky_link[0], sticky_link[1]);
+		}
+	}
 }
 
-static topic_map_t *fetch_topic(const char *topic) {
-	topic_map_t *tm = NULL;
-	HASH_FIND_STR(topic_map, topic, tm);
-	return tm;
+// Stores msg (or nothing if NULL) as the sticky message of tm, returns the replaced one. The shard lock must be held.
+static ps_msg_t *swap_sticky(topic_map_t *tm, ps_msg_t *msg) {
+	ps_msg_t *old_sticky = tm->sticky;
+	__atomic_store_n(&tm->sticky, msg, __ATOMIC_RELEASE);
+	if ((msg != NULL) != (old_sticky != NULL)) {
+		topic_count_sticky(tm, msg != NULL ? 1 : -1);
+	}
+	return old_sticky;
 }
 
-static topic_map_t *fetch_topic_create_if_not_exist(const char *topic) {
-	topic_map_t *tm = NULL;
-	tm = fetch_topic(topic);
-	if (tm == NULL) {
-		tm = create_topic(topic);
+// Removes tm from the tree if it holds nothing, returns 1 if removed. The shard lock of tm must be held.
+static int free_topic_if_empty(topic_map_t *tm) {
+	if (tm->parent == NULL || !topic_is_empty(tm)) {
+		return 0;
 	}
-	return tm;
+	topic_table_del(*topic_children(tm->parent, tm->hashv), tm);
+	if (tm->name != NULL) {
+		rcu_retire((void *) ((uintptr_t) tm->name | 1)); // Readers may be taking a reference to it
+	}
+	rcu_retire(tm->children);
+	rcu_retire(tm);
+	return 1;
 }
 
-static int push_subscriber_queue(ps_subscriber_t *su, ps_msg_t *msg, uint8_t priority) {
-	ps_ref_msg(msg);
-	switch (ps_queue_push(su->q, msg, priority)) {
-	case PS_QUEUE_EFULL:
-		ps_unref_msg(msg);
-	// fallthrough
-	case PS_QUEUE_EOVERFLOW:
-		__sync_add_and_fetch(&su->overflow, 1);
-		return -1;
-	default:
-		break;
+// Removes tm and the ancestors left empty after it
+static void prune_topic(topic_map_t *tm) {
+	while (tm != NULL) {
+		topic_map_t *parent = tm->parent;
+		if (!free_topic_if_empty(tm)) {
+			break;
+		}
+		tm = parent;
 	}
+}
 
-	if (su->non_empty_cb != NULL && ps_queue_waiting(su->q) == 1)
-		(su->non_empty_cb)(su);
+// Calls fn on every child of tm holding sticky messages in its subtree, fn is allowed to remove the child it receives
+static void topic_foreach_sticky_child(topic_map_t *tm, void (*fn)(topic_map_t *, void *), void *ctx) {
+	topic_map_t *child, *tmp;
 
-	if (su->new_msg_cb != NULL)
-		(su->new_msg_cb)(su);
+	if (tm == topic_root) {
+		for (size_t i = 0; i < topic_map_shards; i++) {
+			DL_FOREACH_SAFE2(topic_map[i].sticky_children, child, tmp, sticky_link[1]) {
+				fn(child, ctx);
+			}
+		}
+	} else {
+		DL_FOREACH_SAFE2(tm->sticky_children, child, tmp, sticky_link[1]) {
+			fn(child, ctx);
+		}
+	}
+}
 
-	return 0;
+// Length of the topic path, flags may follow it after a space
+static size_t topic_len(const char *topic) {
+	return strcspn(topic, " ");
 }
 
-static void push_child_sticky(ps_subscriber_t *su, const char *prefix, uint8_t priority) {
-	topic_map_t *tm, *tm_tmp;
+static topic_shard_t *topic_shard_of(const char *topic) {
+	uint32_t hashv;
+	topic_segment(topic, &hashv);
+	return topic_shard(hashv);
+}
 
-	size_t pl = strlen(prefix);
-	HASH_ITER(hh, topic_map, tm, tm_tmp) {
-		if (pl == 0 || (strncmp(prefix, tm->topic, pl) == 0 && (tm->topic[pl] == 0 || tm->topic[pl] == '.'))) {
-			if (tm->sticky != NULL) {
-				push_subscriber_queue(su, tm->sticky, priority);
+/*
+ * Tells whether topic is a wildcard pattern, rewriting the ">" tail wildcard as "#". Returns 1 for
+ * patterns, 0 for plain topics and -1 if a tail wildcard isn't the last segment.
+ */
+static int topic_pattern(char *topic) {
+	int ret = 0;
+	char *seg = topic;
+	for (;;) {
+		size_t len = strcspn(seg, ". ");
+		if (len == 1 && (*seg == '*' || *seg == '#' || *seg == '>')) {
+			if (*seg != '*') {
+				if (seg[1] == '.') {
+					return -1;
+				}
+				*seg = '#';
 			}
+			ret = 1;
 		}
+		if (seg[len] != '.') {
+			break;
+		}
+		seg += len + 1;
 	}
+	return ret;
 }
 
-ps_subscriber_t *ps_new_subscriber(size_t queue_size, const ps_strlist_t subs) {
-	ps_subscriber_t *su = calloc(1, sizeof(ps_subscriber_t));
-	su->q = ps_new_queue(queue_size);
-	su->overflow = false;
-	ps_subscribe_many(su, subs);
-	__sync_add_and_fetch(&stat_live_subscribers, 1);
-	return su;
+static bool segment_is(const char *seg, const char *end, char c) {
+	return end - seg == 1 && *seg == c;
 }
 
-void ps_free_subscriber(ps_subscriber_t *su) {
-	ps_unsubscribe_all(su);
+static topic_map_t *topic_child(topic_map_t *parent, const char *segment, size_t len, uint32_t hashv) {
+	topic_table_t *tt = __atomic_load_n(topic_children(parent, hashv), __ATOMIC_ACQUIRE);
+	if (tt == NULL) {
+		return NULL;
+	}
+	topic_map_t *tm = topic_table_first(tt, hashv & tt->mask);
+	while (tm != NULL) {
+		if (tm->hashv == hashv && tm->len == len && memcmp(tm->segment, segment, len) == 0) {
+			break;
+		}
+		tm = topic_table_next(tt, tm);
+	}
+	return tm;
+}
+
+/*
+ * Descends the topic tree from tm one segment at a time. Returns the deepest existing node of the
+ * path, *exact tells whether it is the node of the whole topic or one of its ancestors.
+ * With create set, the missing nodes are added (the shard lock of the topic must be held).
+ */
+static topic_map_t *topic_walk(topic_map_t *tm, const char *topic, bool create, bool *exact) {
+	const char *seg = topic;
+
+	*exact = true;
+	if (*seg == '\0' || *seg == ' ') {
+		return tm;
+	}
+	for (;;) {
+		uint32_t hashv;
+		const char *end = topic_segment(seg, &hashv);
+		size_t seglen = end - seg;
+		topic_map_t *child = topic_child(tm, seg, seglen, hashv);
+		if (child == NULL) {
+			if (!create) {
+				*exact = false;
+				break;
+			}
+			child = topic_new(tm, seg, seglen, hashv);
+			topic_table_add(topic_children(tm, hashv), child);
+		}
+		tm = child;
+		if (*end != '.') {
+			break;
+		}
+		seg = end + 1;
+	}
+	return tm;
+}
+
+// Gives tm its full path if it has none yet. The shard lock must be held.
+static void topic_set_name(topic_map_t *tm, const char *topic) {
+	if (tm->name == NULL) {
+		__atomic_store_n(&tm->name, topic_name_new(topic, topic_len(topic)), __ATOMIC_RELEASE);
+	}
+}
+
+static topic_map_t *fetch_topic(topic_map_t *root, const char *topic) {
+	bool exact;
+	topic_map_t *tm = topic_walk(root, topic, false, &exact);
+	return exact ? tm : NULL;
+}
+
+static topic_map_t *fetch_topic_create_if_not_exist(topic_map_t *root, const char *topic) {
+	bool exact;
+	return topic_walk(root, topic, true, &exact);
+}
+
+static subscriber_array_t *subscribers_get(topic_map_t *tm) {
+	return __atomic_load_n(&tm->subscribers, __ATOMIC_ACQUIRE);
+}
+
+static uint32_t subscribers_hash(const ps_subscriber_t *su) {
+	return (uint32_t) (((uintptr_t) su * 0x9E3779B97F4A7C15ull) >> 32);
+}
+
+// Returns the entry of su, removed or not
+static subscriber_entry_t *subscribers_lookup(subscriber_array_t *sa, const ps_subscriber_t *su) {
+	if (sa == NULL) {
+		return NULL;
+	}
+	for (uint32_t i = subscribers_hash(su) & sa->mask; sa->index[i] != 0; i = (i + 1) & sa->mask) {
+		subscriber_entry_t *se = &sa->entries[sa->index[i] - 1];
+		if (se->su == su) {
+			return se;
+		}
+	}
+	return NULL;
+}
+
+static void subscribers_append(subscriber_array_t *sa, ps_subscriber_t *su, uint32_t state,
+                               struct subscriptions_list_s *link) {
+	uint32_t idx = sa->count;
+	sa->entries[idx] = (subscriber_entry_t){.su = su, .state = state};
+	sa->links[idx] = link;
+	uint32_t i = subscribers_hash(su) & sa->mask;
+	while (sa->index[i] != 0) {
+		i = (i + 1) & sa->mask;
+	}
+	sa->index[i] = idx + 1;
+	sa->live++;
+	__atomic_store_n(&sa->count, idx + 1, __ATOMIC_RELEASE);
+}
+
+// Replaces the subscribers of tm with a new array of the given size holding the entries not removed
+static subscriber_array_t *subscribers_resize(topic_map_t *tm, uint32_t size) {
+	subscriber_array_t *old = tm->subscribers;
+	uint32_t hsize = 1;
+	while (hsize < size * 2) {
+		hsize <<= 1;
+	}
+	subscriber_array_t *sa = malloc(sizeof(*sa) + size * (sizeof(subscriber_entry_t) + sizeof(*sa->links)) +
+	                                hsize * sizeof(uint32_t));
+	sa->count = sa->live = 0;
+	sa->size = size;
+	sa->mask = hsize - 1;
+	sa->links = (struct subscriptions_list_s **) &sa->entries[size];
+	sa->index = (uint32_t *) &sa->links[size];
+	memset(sa->index, 0, hsize * sizeof(uint32_t));
+	for (uint32_t i = 0; old != NULL && i < old->count; i++) {
+		if (!(old->entries[i].state & SUB_REMOVED)) {
+			subscribers_append(sa, old->entries[i].su, old->entries[i].state, old->links[i]);
+		}
+	}
+	__atomic_store_n(&tm->subscribers, sa, __ATOMIC_RELEASE);
+	rcu_retire(old);
+	return sa;
+}
+
+static subscriber_entry_t *subscribers_find(topic_map_t *tm, ps_subscriber_t *su) {
+	subscriber_entry_t *se = subscribers_lookup(tm->subscribers, su);
+	return se != NULL && !(se->state & SUB_REMOVED) ? se : NULL;
+}
+
+// Adds su, which must not be subscribed to tm. link is its node in the subscriptions of su.
+static void subscribers_add(topic_map_t *tm, ps_subscriber_t *su, uint32_t state, struct subscriptions_list_s *link) {
+	subscriber_array_t *sa = tm->subscribers;
+	subscriber_entry_t *se = subscribers_lookup(sa, su);
+	if (se != NULL) {
+		sa->links[se - sa->entries] = link;
+		__atomic_store_n(&se->state, state, __ATOMIC_RELEASE);
+		sa->live++;
+		return;
+	}
+	if (sa == NULL || sa->count == sa->size) {
+		uint32_t live = sa == NULL ? 0 : sa->live;
+		sa = subscribers_resize(tm, live < SUBSCRIBERS_MIN_SIZE / 2 ? SUBSCRIBERS_MIN_SIZE : (live + 1) * 2);
+	}
+	subscribers_append(sa, su, state, link);
+}
+
+// Removes su from tm, returns the node of the subscription in the list of su or NULL if it wasn't subscribed
+static struct subscriptions_list_s *subscribers_del(topic_map_t *tm, ps_subscriber_t *su) {
+	subscriber_array_t *sa = tm->subscribers;
+	subscriber_entry_t *se = subscribers_find(tm, su);
+	if (se == NULL) {
+		return NULL;
+	}
+	struct subscriptions_list_s *link = sa->links[se - sa->entries];
+	__atomic_store_n(&se->state, se->state | SUB_REMOVED, __ATOMIC_RELEASE);
+	if (--sa->live == 0) {
+		__atomic_store_n(&tm->subscribers, NULL, __ATOMIC_RELEASE);
+		rcu_retire(sa);
+	} else if (sa->count > SUBSCRIBERS_MIN_SIZE && sa->count - sa->live > sa->live) {
+		// Most entries are removed, the copy is paid by the removals since the last one
+		subscribers_resize(tm, sa->live * 2);
+	}
+	return link;
+}
+
+/*
+ * Subscriber callbacks are not called while routing, where the read section and maybe some shard locks are held:
+ * operations that push to queues collect them in a list on their stack and fire them once everything is released.
+ * Each notification holds a subscriber reference, so a subscriber freed meanwhile stays allocated until then.
+ */
+typedef struct notify_s {
+	ps_subscriber_t *su;
+	uint32_t new_msgs;
+	bool non_empty;
+} notify_t;
+
+#define NOTIFY_INLINE 8
+
+typedef struct notify_list_s {
+	notify_t *items;
+	size_t count;
+	size_t size;
+	ps_subscriber_t *firing; // Subscriber whose callback is running
+	struct notify_list_s *prev;
+	notify_t inline_items[NOTIFY_INLINE];
+} notify_list_t;
+
+static _Thread_local notify_list_t *notify_pending;
+
+static void subscriber_ref(ps_subscriber_t *su) {
+	__atomic_add_fetch(&su->refs, 1, __ATOMIC_RELAXED);
+}
+
+static void subscriber_unref(ps_subscriber_t *su) {
+	if (__atomic_sub_fetch(&su->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		free(su);
+	}
+}
+
+static void notify_begin(notify_list_t *nl) {
+	nl->items = nl->inline_items;
+	nl->count = 0;
+	nl->size = NOTIFY_INLINE;
+	nl->firing = NULL;
+	nl->prev = notify_pending;
+	notify_pending = nl;
+}
+
+static void notify_add(ps_subscriber_t *su, bool non_empty, uint32_t new_msgs) {
+	notify_list_t *nl = notify_pending;
+	if (nl->count > 0 && nl->items[nl->count - 1].su == su) {
+		nl->items[nl->count - 1].non_empty |= non_empty;
+		nl->items[nl->count - 1].new_msgs += new_msgs;
+		return;
+	}
+	if (nl->count == nl->size) {
+		notify_t *items = malloc(nl->size * 2 * sizeof(notify_t));
+		memcpy(items, nl->items, nl->count * sizeof(notify_t));
+		if (nl->items != nl->inline_items) {
+			free(nl->items);
+		}
+		nl->items = items;
+		nl->size *= 2;
+	}
+	subscriber_ref(su);
+	nl->items[nl->count++] = (notify_t){.su = su, .non_empty = non_empty, .new_msgs = new_msgs};
+}
+
+// Must be called without holding any lock nor read section
+static void notify_end(notify_list_t *nl) {
+	for (size_t i = 0; i < nl->count; i++) {
+		notify_t *n = &nl->items[i];
+		ps_subscriber_t *su = n->su;
+		nl->firing = su;
+		// Pairs with ps_free_subscriber: either it sees us running or we see it closed
+		__atomic_add_fetch(&su->running, 1, __ATOMIC_SEQ_CST);
+		if (!__atomic_load_n(&su->closed, __ATOMIC_SEQ_CST)) {
+			ps_non_empty_cb_t non_empty_cb = __atomic_load_n(&su->non_empty_cb, __ATOMIC_ACQUIRE);
+			if (non_empty_cb != NULL && n->non_empty)
+				non_empty_cb(su);
+
+			ps_new_msg_cb_t new_msg_cb = __atomic_load_n(&su->new_msg_cb, __ATOMIC_ACQUIRE);
+			for (uint32_t k = 0; new_msg_cb != NULL && k < n->new_msgs; k++)
+				new_msg_cb(su);
+		}
+		__atomic_sub_fetch(&su->running, 1, __ATOMIC_SEQ_CST);
+		nl->firing = NULL;
+		subscriber_unref(su);
+	}
+	notify_pending = nl->prev;
+	if (nl->items != nl->inline_items) {
+		free(nl->items);
+	}
+}
+
+// Queues the callbacks of su after pushing messages to it
+static void notify_pushed(ps_subscriber_t *su, size_t pushed) {
+	bool non_empty = __atomic_load_n(&su->non_empty_cb, __ATOMIC_ACQUIRE) != NULL && ps_queue_waiting(su->q) == pushed;
+	bool new_msg = __atomic_load_n(&su->new_msg_cb, __ATOMIC_ACQUIRE) != NULL;
+	if (non_empty || new_msg) {
+		notify_add(su, non_empty, new_msg ? pushed : 0);
+	}
+}
+
+static int push_subscriber_queue(ps_subscriber_t *su, ps_msg_t *msg, uint8_t priority) {
+	ps_ref_msg(msg);
+	switch (ps_queue_push(su->q, msg, priority)) {
+	case PS_QUEUE_EFULL:
+		if (su->spill != NULL) {
+			su->spill(su, msg);
+			return 0;
+		}
+		ps_unref_msg(msg);
+	// fallthrough
+	case PS_QUEUE_EOVERFLOW:
+		__sync_add_and_fetch(&su->overflow, 1);
+		return -1;
+	default:
+		break;
+	}
+
+	notify_pushed(su, 1);
+	return 0;
+}
+
+typedef struct child_sticky_ctx_s {
+	ps_subscriber_t *su;
+	uint8_t priority;
+} child_sticky_ctx_t;
+
+static void push_child_sticky(topic_map_t *tm, void *ctx) {
+	child_sticky_ctx_t *cs = ctx;
+	if (tm->sticky != NULL) {
+		push_subscriber_queue(cs->su, tm->sticky, cs->priority);
+	}
+	topic_foreach_sticky_child(tm, push_child_sticky, ctx);
+}
+
+typedef struct pattern_sticky_ctx_s {
+	child_sticky_ctx_t cs;
+	bool child_sticky;
+	const char *seg; // Pattern left to match, NULL once matched
+} pattern_sticky_ctx_t;
+
+// Pushes the sticky messages of the topics below tm matching the rest of the pattern
+static void push_pattern_sticky(topic_map_t *tm, void *ctx) {
+	pattern_sticky_ctx_t *ps = ctx;
+	if (tm->parent != NULL && tm->stickies == 0) {
+		return;
+	}
+	if (ps->seg == NULL) {
+		if (ps->child_sticky) {
+			push_child_sticky(tm, &ps->cs);
+		} else if (tm->sticky != NULL) {
+			push_subscriber_queue(ps->cs.su, tm->sticky, ps->cs.priority);
+		}
+		return;
+	}
+	uint32_t hashv;
+	const char *end = topic_segment(ps->seg, &hashv);
+	pattern_sticky_ctx_t next = *ps;
+	next.seg = *end == '.' ? end + 1 : NULL;
+	if (segment_is(ps->seg, end, '#')) {
+		topic_foreach_sticky_child(tm, push_child_sticky, &ps->cs);
+	} else if (segment_is(ps->seg, end, '*')) {
+		topic_foreach_sticky_child(tm, push_pattern_sticky, &next);
+	} else {
+		topic_map_t *child = topic_child(tm, ps->seg, end - ps->seg, hashv);
+		if (child != NULL) {
+			push_pattern_sticky(child, &next);
+		}
+	}
+}
+
+// Subscribers created by the library itself are not accounted in the stats
+static ps_subscriber_t *subscriber_new(size_t queue_size) {
+	ps_subscriber_t *su = calloc(1, sizeof(ps_subscriber_t));
+	su->q = ps_new_queue(queue_size);
+	mutex_init(&su->mux);
+	su->overflow = false;
+	su->fd = -1;
+	su->refs = 1;
+	return su;
+}
+
+ps_subscriber_t *ps_new_subscriber(size_t queue_size, const ps_strlist_t subs) {
+	ps_subscriber_t *su = subscriber_new(queue_size);
+	ps_subscribe_many(su, subs);
+	__sync_add_and_fetch(&stat_live_subscribers, 1);
+	return su;
+}
+
+static void subscriber_free(ps_subscriber_t *su) {
+	__atomic_store_n(&su->closed, true, __ATOMIC_SEQ_CST);
+	ps_unsubscribe_all(su);
+	rcu_synchronize(); // Wait for publishers that could still be pushing to our queue
+	ps_dispatcher_remove(su);
 	ps_flush(su);
+
+	// Wait for its callbacks running in other threads, the ones of this thread are the caller
+	uint32_t own = 0;
+	for (notify_list_t *nl = notify_pending; nl != NULL; nl = nl->prev) {
+		if (nl->firing == su)
+			own++;
+	}
+	while (__atomic_load_n(&su->running, __ATOMIC_SEQ_CST) > own) {
+		thread_yield();
+	}
+
 	ps_free_queue(su->q);
-	free(su);
+	if (su->fd >= 0)
+		close(su->fd);
+	mutex_destroy(&su->mux);
+	subscriber_unref(su); // Pending notifications may still reference it
+}
+
+void ps_free_subscriber(ps_subscriber_t *su) {
+	subscriber_free(su);
 	__sync_sub_and_fetch(&stat_live_subscribers, 1);
 }
 
@@ -331,25 +1522,332 @@ void *ps_subscriber_user_data(ps_subscriber_t *s) {
 }
 
 void ps_set_new_msg_cb(ps_subscriber_t *su, ps_new_msg_cb_t cb) {
-	GLOBAL_LOCK
-	su->new_msg_cb = cb;
-	if (ps_queue_waiting(su->q) > 0) {
-		if (su->new_msg_cb != NULL) {
-			(su->new_msg_cb)(su);
-		}
+	notify_list_t nl;
+	notify_begin(&nl);
+	mutex_lock(su->mux);
+	__atomic_store_n(&su->new_msg_cb, cb, __ATOMIC_RELEASE);
+	if (cb != NULL && ps_queue_waiting(su->q) > 0) {
+		notify_add(su, false, 1);
 	}
-	GLOBAL_UNLOCK
+	mutex_unlock(su->mux);
+	notify_end(&nl);
 }
 
 void ps_set_non_empty_cb(ps_subscriber_t *su, ps_non_empty_cb_t cb) {
-	GLOBAL_LOCK
-	su->non_empty_cb = cb;
-	if (ps_queue_waiting(su->q) > 0) {
-		if (su->non_empty_cb != NULL) {
-			(su->non_empty_cb)(su);
+	notify_list_t nl;
+	notify_begin(&nl);
+	mutex_lock(su->mux);
+	__atomic_store_n(&su->non_empty_cb, cb, __ATOMIC_RELEASE);
+	if (cb != NULL && ps_queue_waiting(su->q) > 0) {
+		notify_add(su, true, 0);
+	}
+	mutex_unlock(su->mux);
+	notify_end(&nl);
+}
+
+/*
+ * Dispatcher: the queue notifies its subscriber on every empty to non-empty transition, which makes the subscriber
+ * runnable in its dispatcher. The sched state makes sure it is queued or run by only one worker at a time.
+ */
+enum {
+	SCHED_IDLE,
+	SCHED_QUEUED,
+	SCHED_RUNNING,
+	SCHED_NOTIFIED, // Running, and a message arrived after its last pull
+};
+
+#define DISPATCH_BUDGET 32 // Messages handled before letting the other subscribers of the worker run
+#define DEQUE_MIN_SIZE 16
+
+typedef struct worker_s {
+	mutex_t lock;
+	ps_subscriber_t **items; // Ring of runnable subscribers, the owner pops the front and thieves the back
+	size_t head;
+	size_t count;
+	size_t size;
+	thread_t thread;
+	ps_dispatcher_t *d;
+} __attribute__((aligned(64))) worker_t;
+
+struct ps_dispatcher_s {
+	worker_t *workers;
+	size_t nworkers;
+	uint32_t next; // Round robin of the schedules from outside the pool
+	uint32_t idle; // Workers about to sleep
+	bool stop;
+	semaphore_t wake;
+	mutex_t lock;          // Protects subs
+	ps_subscriber_t *subs; // Added subscribers
+};
+
+static _Thread_local worker_t *dispatch_worker;
+static _Thread_local ps_subscriber_t *dispatch_current; // Subscriber whose handler is running
+
+static void deque_push(worker_t *w, ps_subscriber_t *su) {
+	mutex_lock(w->lock);
+	if (w->count == w->size) {
+		size_t size = w->size ? w->size * 2 : DEQUE_MIN_SIZE;
+		ps_subscriber_t **items = malloc(size * sizeof(ps_subscriber_t *));
+		for (size_t i = 0; i < w->count; i++) {
+			items[i] = w->items[(w->head + i) % w->size];
+		}
+		free(w->items);
+		w->items = items;
+		w->head = 0;
+		w->size = size;
+	}
+	w->items[(w->head + w->count++) % w->size] = su;
+	mutex_unlock(w->lock);
+}
+
+static ps_subscriber_t *deque_pop(worker_t *w, bool back) {
+	ps_subscriber_t *su = NULL;
+	mutex_lock(w->lock);
+	if (w->count > 0) {
+		if (back) {
+			su = w->items[(w->head + w->count - 1) % w->size];
+		} else {
+			su = w->items[w->head];
+			w->head = (w->head + 1) % w->size;
+		}
+		w->count--;
+	}
+	mutex_unlock(w->lock);
+	return su;
+}
+
+// Takes a runnable subscriber from our own deque or steals one from another worker
+static ps_subscriber_t *dispatcher_take(worker_t *w) {
+	ps_dispatcher_t *d = w->d;
+	ps_subscriber_t *su = deque_pop(w, false);
+	size_t self = w - d->workers;
+	for (size_t i = 1; su == NULL && i < d->nworkers; i++) {
+		su = deque_pop(&d->workers[(self + i) % d->nworkers], true);
+	}
+	return su;
+}
+
+static void dispatcher_enqueue(ps_dispatcher_t *d, ps_subscriber_t *su) {
+	worker_t *w = dispatch_worker;
+	if (w == NULL || w->d != d) {
+		w = &d->workers[__atomic_fetch_add(&d->next, 1, __ATOMIC_RELAXED) % d->nworkers];
+	}
+	deque_push(w, su);
+	// Pairs with the idle registration in dispatcher_worker
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&d->idle, __ATOMIC_RELAXED) > 0)
+		semaphore_post(d->wake);
+}
+
+static void dispatcher_schedule(ps_dispatcher_t *d, ps_subscriber_t *su) {
+	uint32_t state = __atomic_load_n(&su->sched, __ATOMIC_SEQ_CST);
+	for (;;) {
+		if (state == SCHED_IDLE) {
+			if (__atomic_compare_exchange_n(&su->sched, &state, SCHED_QUEUED, false, __ATOMIC_SEQ_CST,
+			                                __ATOMIC_SEQ_CST)) {
+				subscriber_ref(su); // Released when it goes idle again
+				dispatcher_enqueue(d, su);
+				return;
+			}
+		} else if (state == SCHED_RUNNING) {
+			if (__atomic_compare_exchange_n(&su->sched, &state, SCHED_NOTIFIED, false, __ATOMIC_SEQ_CST,
+			                                __ATOMIC_SEQ_CST)) {
+				return;
+			}
+		} else {
+			return; // It will run anyway
+		}
+	}
+}
+
+static void subscriber_notify(void *ctx) {
+	ps_subscriber_t *su = ctx;
+#ifdef __linux__
+	int fd = __atomic_load_n(&su->fd, __ATOMIC_ACQUIRE);
+	if (fd >= 0 && write(fd, &(uint64_t){1}, sizeof(uint64_t)) < 0) {
+		// Only fails if the counter would overflow, the descriptor is readable anyway
+	}
+#endif
+	// ps_free_dispatcher synchronizes with the readers that may still see it
+	rcu_token_t token = rcu_read_lock();
+	ps_dispatcher_t *d = __atomic_load_n(&su->dispatcher, __ATOMIC_ACQUIRE);
+	if (d != NULL)
+		dispatcher_schedule(d, su);
+	rcu_read_unlock(token);
+}
+
+// Runs the handler of a queued subscriber. Its queue is only touched while it is running in this dispatcher,
+// which is what ps_dispatcher_remove waits for.
+static void dispatcher_run(worker_t *w, ps_subscriber_t *su) {
+	__atomic_store_n(&su->sched, SCHED_RUNNING, __ATOMIC_SEQ_CST);
+	for (size_t n = 0; __atomic_load_n(&su->dispatcher, __ATOMIC_SEQ_CST) == w->d; n++) {
+		if (n == DISPATCH_BUDGET) {
+			__atomic_store_n(&su->sched, SCHED_QUEUED, __ATOMIC_SEQ_CST);
+			deque_push(w, su);
+			return;
+		}
+		ps_msg_t *msg = ps_queue_pull(su->q, 0);
+		if (msg == NULL) {
+			uint32_t running = SCHED_RUNNING;
+			if (__atomic_compare_exchange_n(&su->sched, &running, SCHED_IDLE, false, __ATOMIC_SEQ_CST,
+			                                __ATOMIC_SEQ_CST)) {
+				subscriber_unref(su);
+				return;
+			}
+			// Notified after the pull, look again
+			__atomic_store_n(&su->sched, SCHED_RUNNING, __ATOMIC_SEQ_CST);
+			continue;
+		}
+		ps_subscriber_t *prev = dispatch_current;
+		dispatch_current = su;
+		su->handler(su, msg);
+		dispatch_current = prev;
+		ps_unref_msg(msg);
+	}
+	__atomic_store_n(&su->sched, SCHED_IDLE, __ATOMIC_SEQ_CST);
+	// It may have been moved to another dispatcher while we had it
+	rcu_token_t token = rcu_read_lock();
+	ps_dispatcher_t *d = __atomic_load_n(&su->dispatcher, __ATOMIC_ACQUIRE);
+	if (d != NULL)
+		dispatcher_schedule(d, su);
+	rcu_read_unlock(token);
+	subscriber_unref(su);
+}
+
+static void dispatcher_worker(void *arg) {
+	worker_t *w = arg;
+	ps_dispatcher_t *d = w->d;
+	dispatch_worker = w;
+	while (!__atomic_load_n(&d->stop, __ATOMIC_ACQUIRE)) {
+		ps_subscriber_t *su = dispatcher_take(w);
+		if (su == NULL) {
+			__atomic_add_fetch(&d->idle, 1, __ATOMIC_SEQ_CST);
+			su = dispatcher_take(w); // An enqueue may have missed our registration
+			if (su == NULL && !__atomic_load_n(&d->stop, __ATOMIC_ACQUIRE))
+				semaphore_wait(d->wake, -1);
+			__atomic_sub_fetch(&d->idle, 1, __ATOMIC_SEQ_CST);
+		}
+		if (su != NULL)
+			dispatcher_run(w, su);
+	}
+	dispatch_worker = NULL;
+}
+
+ps_dispatcher_t *ps_new_dispatcher(size_t workers) {
+	if (workers == 0)
+		return NULL;
+	ps_dispatcher_t *d = calloc(1, sizeof(ps_dispatcher_t));
+	d->nworkers = workers;
+	d->workers = aligned_alloc(64, workers * sizeof(worker_t));
+	memset(d->workers, 0, workers * sizeof(worker_t));
+	semaphore_init(&d->wake, 0);
+	mutex_init(&d->lock);
+	for (size_t i = 0; i < workers; i++) {
+		d->workers[i].d = d;
+		mutex_init(&d->workers[i].lock);
+	}
+	for (size_t i = 0; i < workers; i++) {
+		if (thread_create(&d->workers[i].thread, dispatcher_worker, &d->workers[i]) != 0) {
+			d->nworkers = i; // Only join the started ones
+			ps_free_dispatcher(d);
+			return NULL;
+		}
+	}
+	return d;
+}
+
+void ps_free_dispatcher(ps_dispatcher_t *d) {
+	if (d == NULL)
+		return;
+	// Detach the subscribers still added, they keep working with ps_get
+	ps_subscriber_t *su, *tmp;
+	mutex_lock(d->lock);
+	DL_FOREACH_SAFE2(d->subs, su, tmp, dnext) {
+		__atomic_store_n(&su->dispatcher, NULL, __ATOMIC_SEQ_CST);
+		DL_DELETE2(d->subs, su, dprev, dnext);
+	}
+	mutex_unlock(d->lock);
+	rcu_synchronize(); // No notification or removal can be using it anymore
+	__atomic_store_n(&d->stop, true, __ATOMIC_RELEASE);
+	semaphore_post_n(d->wake, d->nworkers);
+	for (size_t i = 0; i < d->nworkers; i++) {
+		thread_join(&d->workers[i].thread);
+	}
+	for (size_t i = 0; i < d->nworkers; i++) {
+		while ((su = deque_pop(&d->workers[i], false)) != NULL) {
+			__atomic_store_n(&su->sched, SCHED_IDLE, __ATOMIC_SEQ_CST);
+			subscriber_unref(su);
+		}
+		free(d->workers[i].items);
+		mutex_destroy(&d->workers[i].lock);
+	}
+	semaphore_destroy(&d->wake);
+	mutex_destroy(&d->lock);
+	free(d->workers);
+	free(d);
+}
+
+int ps_dispatcher_add(ps_dispatcher_t *d, ps_subscriber_t *su, ps_handler_t handler) {
+	if (d == NULL || handler == NULL)
+		return -1;
+	mutex_lock(su->mux);
+	if (su->dispatcher != NULL) {
+		mutex_unlock(su->mux);
+		return -1;
+	}
+	su->handler = handler;
+	mutex_lock(d->lock);
+	__atomic_store_n(&su->dispatcher, d, __ATOMIC_SEQ_CST);
+	DL_APPEND2(d->subs, su, dprev, dnext);
+	mutex_unlock(d->lock);
+	mutex_unlock(su->mux);
+	ps_queue_set_notify(su->q, subscriber_notify, su); // Schedules it right away if it has messages
+	return 0;
+}
+
+int ps_dispatcher_remove(ps_subscriber_t *su) {
+	mutex_lock(su->mux);
+	// ps_free_dispatcher may be detaching it, it frees the dispatcher after a grace period
+	rcu_token_t token = rcu_read_lock();
+	ps_dispatcher_t *d = __atomic_load_n(&su->dispatcher, __ATOMIC_ACQUIRE);
+	if (d != NULL) {
+		mutex_lock(d->lock);
+		if (su->dispatcher == d) {
+			__atomic_store_n(&su->dispatcher, NULL, __ATOMIC_SEQ_CST);
+			DL_DELETE2(d->subs, su, dprev, dnext);
+			mutex_unlock(d->lock);
+		} else {
+			mutex_unlock(d->lock);
+			d = NULL;
 		}
 	}
-	GLOBAL_UNLOCK
+	rcu_read_unlock(token);
+	mutex_unlock(su->mux);
+	if (d == NULL)
+		return -1;
+
+	// Pairs with dispatcher_run: either it sees it removed or we see it running
+	while (dispatch_current != su && __atomic_load_n(&su->sched, __ATOMIC_SEQ_CST) >= SCHED_RUNNING) {
+		thread_yield();
+	}
+	return 0;
+}
+
+int ps_subscriber_fd(ps_subscriber_t *su) {
+#ifdef __linux__
+	mutex_lock(su->mux);
+	if (su->fd < 0) {
+		__atomic_store_n(&su->fd, eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC), __ATOMIC_RELEASE);
+		if (su->fd >= 0)
+			ps_queue_set_notify(su->q, subscriber_notify, su);
+	}
+	int fd = su->fd;
+	mutex_unlock(su->mux);
+	return fd;
+#else
+	(void) su;
+	return -1;
+#endif
 }
 
 int ps_stats_live_subscribers(void) {
@@ -385,7 +1883,6 @@ int ps_subscribe(ps_subscriber_t *su, const char *topic_orig) {
 int ps_subscribe_flags(ps_subscriber_t *su, const char *topic_orig, ps_sub_flags_t *pflags) {
 	int ret = 0;
 	topic_map_t *tm;
-	subscriber_list_t *sl;
 	subscriptions_list_t *subs;
 
 	char *topic = strdup(topic_orig);
@@ -429,34 +1926,60 @@ int ps_subscribe_flags(ps_subscriber_t *su, const char *topic_orig, ps_sub_flags
 		}
 	}
 
-	GLOBAL_LOCK
-	tm = fetch_topic_create_if_not_exist(topic);
-	DL_SEARCH_SCALAR(tm->subscribers, sl, su, su);
-	if (sl != NULL) {
+	int pattern = topic_pattern(topic);
+	if (pattern < 0) {
+		free(topic);
+		return -1;
+	}
+
+	// The whole subtree of a topic is in its shard, except for the root which spans all of them.
+	// Patterns can match sticky messages of any shard.
+	bool all_shards = !no_sticky_flag && (pattern || (child_sticky_flag && *topic == '\0'));
+	topic_shard_t *sh = pattern ? &wildcard_shard : topic_shard_of(topic);
+	notify_list_t nl;
+	notify_begin(&nl);
+	mutex_lock(su->mux);
+	if (all_shards) {
+		lock_all_shards();
+	}
+	if (!all_shards || pattern) {
+		mutex_lock(sh->lock);
+	}
+	tm = fetch_topic_create_if_not_exist(pattern ? wildcard_root : topic_root, topic);
+	if (!pattern && strlen(topic) >= MSG_TOPIC_INLINE) {
+		topic_set_name(tm, topic); // Messages created on it share it instead of copying the topic
+	}
+	if (subscribers_find(tm, su) != NULL) {
 		ret = -1;
 		goto exit_fn;
 	}
-	sl = calloc(1, sizeof(*sl));
-	sl->su = su;
-	sl->hidden = hidden_flag;
-	sl->on_empty = on_empty_flag;
-	sl->priority = priority;
-	DL_APPEND(tm->subscribers, sl);
 	subs = calloc(1, sizeof(*subs));
 	subs->tm = tm;
 	DL_APPEND(su->subs, subs);
+	subscribers_add(tm, su, priority | (hidden_flag ? SUB_HIDDEN : 0) | (on_empty_flag ? SUB_ON_EMPTY : 0), subs);
 	if (!no_sticky_flag) {
-		if (child_sticky_flag) {
-			push_child_sticky(su, topic, sl->priority);
+		if (pattern) {
+			push_pattern_sticky(topic_root, &(pattern_sticky_ctx_t){.cs = {.su = su, .priority = priority},
+			                                                         .child_sticky = child_sticky_flag,
+			                                                         .seg = topic});
+		} else if (child_sticky_flag) {
+			push_child_sticky(tm, &(child_sticky_ctx_t){.su = su, .priority = priority});
 		} else {
 			if (tm->sticky != NULL) {
-				push_subscriber_queue(su, tm->sticky, sl->priority);
+				push_subscriber_queue(su, tm->sticky, priority);
 			}
 		}
 	}
 
 exit_fn:
-	GLOBAL_UNLOCK
+	if (!all_shards || pattern) {
+		mutex_unlock(sh->lock);
+	}
+	if (all_shards) {
+		unlock_all_shards();
+	}
+	mutex_unlock(su->mux);
+	notify_end(&nl);
 	free(topic);
 	return ret;
 }
@@ -464,7 +1987,6 @@ exit_fn:
 int ps_unsubscribe(ps_subscriber_t *su, const char *otopic) {
 	int ret = 0;
 	topic_map_t *tm;
-	subscriber_list_t *sl;
 	subscriptions_list_t *subs;
 
 	char *topic = strdup(otopic);
@@ -473,28 +1995,27 @@ int ps_unsubscribe(ps_subscriber_t *su, const char *otopic) {
 		*fl_str = '\0';
 	}
 
-	GLOBAL_LOCK
-	tm = fetch_topic(topic);
+	int pattern = topic_pattern(topic);
+	topic_shard_t *sh = pattern ? &wildcard_shard : topic_shard_of(topic);
+	mutex_lock(su->mux);
+	mutex_lock(sh->lock);
+	tm = fetch_topic(pattern ? wildcard_root : topic_root, topic);
 	if (tm == NULL) {
 		ret = -1;
 		goto exit_fn;
 	}
-	DL_SEARCH_SCALAR(tm->subscribers, sl, su, su);
-	if (sl == NULL) {
+	subs = subscribers_del(tm, su);
+	if (subs == NULL) {
 		ret = -1;
 		goto exit_fn;
 	}
-	DL_DELETE(tm->subscribers, sl);
-	free(sl);
-	free_topic_if_empty(tm);
-	DL_SEARCH_SCALAR(su->subs, subs, tm, tm);
-	if (subs != NULL) {
-		DL_DELETE(su->subs, subs);
-		free(subs);
-	}
+	DL_DELETE(su->subs, subs);
+	free(subs);
+	prune_topic(tm);
 
 exit_fn:
-	GLOBAL_UNLOCK
+	mutex_unlock(sh->lock);
+	mutex_unlock(su->mux);
 	free(topic);
 	return ret;
 }
@@ -513,25 +2034,24 @@ int ps_unsubscribe_many(ps_subscriber_t *su, const ps_strlist_t subs) {
 
 int ps_unsubscribe_all(ps_subscriber_t *su) {
 	subscriptions_list_t *s, *ps;
-	subscriber_list_t *sl;
 	size_t count = 0;
 
-	GLOBAL_LOCK
+	mutex_lock(su->mux);
 	s = su->subs;
 	while (s != NULL) {
-		DL_SEARCH_SCALAR(s->tm->subscribers, sl, su, su);
-		if (sl != NULL) {
-			DL_DELETE(s->tm->subscribers, sl);
-			free(sl);
-			free_topic_if_empty(s->tm);
+		topic_shard_t *sh = s->tm->shard;
+		mutex_lock(sh->lock);
+		if (subscribers_del(s->tm, su) != NULL) {
+			prune_topic(s->tm);
 		}
+		mutex_unlock(sh->lock);
 		ps = s;
 		s = s->next;
 		free(ps);
 		count++;
 	}
 	su->subs = NULL;
-	GLOBAL_UNLOCK
+	mutex_unlock(su->mux);
 	return count;
 }
 
@@ -539,6 +2059,10 @@ ps_msg_t *ps_get(ps_subscriber_t *su, int64_t timeout) {
 	return ps_queue_pull(su->q, timeout);
 }
 
+size_t ps_get_many(ps_subscriber_t *su, ps_msg_t **msgs, size_t max, int64_t timeout) {
+	return ps_queue_pull_many(su->q, msgs, max, timeout);
+}
+
 int ps_num_subs(ps_subscriber_t *su) {
 	int count;
 	subscriptions_list_t *elt;
@@ -556,142 +2080,1257 @@ int ps_overflow(ps_subscriber_t *su) {
 	return n;
 }
 
+static void clean_sticky(topic_map_t *tm, void *ctx) {
+	if (tm->parent != NULL && tm->stickies == 0) {
+		return; // Nothing to clean below, and the nodes are kept by something else
+	}
+	topic_foreach_sticky_child(tm, clean_sticky, ctx);
+	ps_unref_msg(swap_sticky(tm, NULL));
+	free_topic_if_empty(tm);
+}
+
 void ps_clean_sticky(const char *prefix) {
-	topic_map_t *tm, *tm_tmp;
+	bool all_shards = topic_len(prefix) == 0;
+	topic_shard_t *sh = topic_shard_of(prefix);
+	if (all_shards) {
+		lock_all_shards();
+	} else {
+		mutex_lock(sh->lock);
+	}
+	topic_map_t *tm = fetch_topic(topic_root, prefix);
+	if (tm != NULL) {
+		topic_map_t *parent = tm->parent;
+		clean_sticky(tm, NULL);
+		prune_topic(parent);
+	}
+	if (all_shards) {
+		unlock_all_shards();
+	} else {
+		mutex_unlock(sh->lock);
+	}
+}
 
-	size_t pl = strlen(prefix);
-	GLOBAL_LOCK
-	HASH_ITER(hh, topic_map, tm, tm_tmp) {
-		if (pl == 0 || (strncmp(prefix, tm->topic, pl) == 0 && (tm->topic[pl] == 0 || tm->topic[pl] == '.'))) {
-			if (tm->sticky != NULL) {
-				ps_unref_msg(tm->sticky);
-				tm->sticky = NULL;
-				free_topic_if_empty(tm);
-			}
+#ifdef __linux__
+/*
+ * Sticky snapshot file: a header followed by one record per message, in native byte order. Each record is followed
+ * by its NUL terminated topic and the string, buffer or error description of its value, padded to STICKY_ALIGN, so
+ * the loader uses the mapped file in place.
+ */
+#define STICKY_MAGIC 0x54535350u // "PSST"
+#define STICKY_VERSION 1
+#define STICKY_ALIGN 8
+
+typedef struct sticky_header_s {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t size; // File size
+	uint64_t count;
+} sticky_header_t;
+
+typedef struct sticky_record_s {
+	uint32_t flags;
+	int32_t priority;
+	uint32_t topic_len;
+	uint32_t data_len; // 0 if the value has no data
+	union {
+		int64_t int_val; // Also bool values and error ids
+		double dbl_val;
+	};
+} sticky_record_t;
+
+// Loaded snapshot, unmapped when the last message pointing into it is freed
+typedef struct sticky_map_s {
+	void *base;
+	size_t size;
+} sticky_map_t;
+
+typedef struct sticky_list_s {
+	ps_msg_t **msgs;
+	size_t count;
+	size_t size;
+} sticky_list_t;
+
+static void collect_sticky(topic_map_t *tm, void *ctx) {
+	sticky_list_t *sl = ctx;
+	// Pointers mean nothing to another process
+	if (tm->sticky != NULL && !PS_IS_PTR(tm->sticky)) {
+		if (sl->count == sl->size) {
+			sl->size = sl->size != 0 ? sl->size * 2 : 64;
+			sl->msgs = realloc(sl->msgs, sl->size * sizeof(ps_msg_t *));
 		}
+		sl->msgs[sl->count++] = ps_ref_msg(tm->sticky);
 	}
-	GLOBAL_UNLOCK
+	topic_foreach_sticky_child(tm, collect_sticky, ctx);
 }
 
-int ps_publish(ps_msg_t *msg) {
-	if (msg == NULL)
-		return 0;
-	topic_map_t *tm = NULL;
-	subscriber_list_t *sl = NULL;
-	size_t ret = 0;
-	char *topic = strdup(msg->topic);
+// Data stored after the topic of msg
+static const void *sticky_data(const ps_msg_t *msg, uint32_t *len) {
+	*len = 0;
+	if (PS_IS_STR(msg) && msg->str_val != NULL) {
+		*len = strlen(msg->str_val) + 1;
+		return msg->str_val;
+	} else if (PS_IS_BUF(msg) && msg->buf_val.ptr != NULL) {
+		*len = msg->buf_val.sz;
+		return msg->buf_val.ptr;
+	} else if (PS_IS_ERR(msg) && msg->err_val.desc != NULL) {
+		*len = strlen(msg->err_val.desc) + 1;
+		return msg->err_val.desc;
+	}
+	return NULL;
+}
 
-	char *fl_str = strchr(topic, ' ');
-	if (fl_str != NULL)
-		*fl_str = '\0';
+static size_t sticky_record_size(uint32_t topic_len, uint32_t data_len) {
+	size_t sz = sizeof(sticky_record_t) + topic_len + 1 + data_len;
+	return (sz + STICKY_ALIGN - 1) & ~(size_t) (STICKY_ALIGN - 1);
+}
 
-	GLOBAL_LOCK
-	bool first = true;
-	for (;;) {
-		tm = fetch_topic(topic);
-		if (first) {
-			first = false;
-			if (msg->flags & PS_FL_STICKY) {
-				if (tm == NULL) {
-					tm = create_topic(topic);
-				}
-				if (tm->sticky != NULL) {
-					ps_unref_msg(tm->sticky);
-				}
-				tm->sticky = ps_ref_msg(msg);
-			} else {
-				if (tm != NULL && tm->sticky != NULL) {
-					ps_unref_msg(tm->sticky);
-					tm->sticky = NULL;
-					if (free_topic_if_empty(tm)) {
-						tm = NULL;
-					}
-				}
-			}
-		}
-		if (tm != NULL) {
-			DL_FOREACH (tm->subscribers, sl) {
-				if (sl->on_empty && ps_waiting(sl->su) != 0) {
-					continue;
-				}
-				if (push_subscriber_queue(sl->su, msg, sl->priority) == 0 && !sl->hidden) {
-					ret++;
-				}
-			}
-		}
-		if (msg->flags & PS_FL_NONRECURSIVE)
-			break;
+static size_t sticky_record_write(char *p, const ps_msg_t *msg) {
+	sticky_record_t *rec = (sticky_record_t *) p;
+	uint32_t data_len;
+	const void *data = sticky_data(msg, &data_len);
+	rec->flags = msg->flags;
+	rec->priority = msg->priority;
+	rec->topic_len = ps_msg_topic_len(msg);
+	rec->data_len = data_len;
+	if (PS_IS_INT(msg)) {
+		rec->int_val = msg->int_val;
+	} else if (PS_IS_DBL(msg)) {
+		rec->dbl_val = msg->dbl_val;
+	} else if (PS_IS_BOOL(msg)) {
+		rec->int_val = msg->bool_val;
+	} else if (PS_IS_ERR(msg)) {
+		rec->int_val = msg->err_val.id;
+	}
+	p += sizeof(sticky_record_t);
+	memcpy(p, msg->topic, rec->topic_len);
+	p += rec->topic_len + 1;
+	if (data_len > 0) {
+		memcpy(p, data, data_len);
+	}
+	return sticky_record_size(rec->topic_len, data_len);
+}
 
-		if (topic[0] == '\0') {
-			break;
+static int write_file(const char *path, const char *buf, size_t size) {
+	size_t len = strlen(path);
+	char *tmp = malloc(len + sizeof(".tmp"));
+	memcpy(tmp, path, len);
+	memcpy(tmp + len, ".tmp", sizeof(".tmp"));
+	int ret = -1;
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd >= 0) {
+		size_t done = 0;
+		while (done < size) {
+			ssize_t n = write(fd, buf + done, size - done);
+			if (n <= 0)
+				break;
+			done += n;
+		}
+		// Written under another name first, a crash never leaves a truncated snapshot behind
+		if (done == size && fsync(fd) == 0 && close(fd) == 0) {
+			ret = rename(tmp, path);
+		} else {
+			close(fd);
 		}
+		if (ret != 0)
+			unlink(tmp);
+	}
+	free(tmp);
+	return ret;
+}
 
-		for (size_t n = strlen(topic); n > 0; n--) {
-			if (topic[n - 1] == '.') {
-				topic[n - 1] = 0;
-				break;
+// Returns the record at *off and moves *off to the next one, NULL if it isn't a valid record
+static sticky_record_t *sticky_record_next(char *base, size_t size, size_t *off) {
+	if (size - *off < sizeof(sticky_record_t))
+		return NULL;
+	sticky_record_t *rec = (sticky_record_t *) (base + *off);
+	uint32_t typ = rec->flags & PS_MSK_TYP;
+	if (typ == PS_PTR_TYP || typ > PS_NIL_TYP)
+		return NULL;
+	if ((uint64_t) rec->topic_len + rec->data_len >= size - *off - sizeof(sticky_record_t))
+		return NULL;
+	char *topic = (char *) (rec + 1);
+	if (topic[rec->topic_len] != '\0' || memchr(topic, '\0', rec->topic_len) != NULL)
+		return NULL;
+	char *data = topic + rec->topic_len + 1;
+	if ((typ == PS_STR_TYP || typ == PS_ERR_TYP) && rec->data_len > 0 && data[rec->data_len - 1] != '\0')
+		return NULL;
+	size_t rec_size = sticky_record_size(rec->topic_len, rec->data_len);
+	if (rec_size > size - *off)
+		return NULL;
+	*off += rec_size;
+	return rec;
+}
+
+static void sticky_unmap(void *ptr) {
+	sticky_map_t *map = ptr;
+	munmap(map->base, map->size);
+	free(map);
+}
+
+// Builds the message of rec, values with data point into the mapped file and hold a reference to it
+static ps_msg_t *sticky_record_msg(sticky_record_t *rec, msg_payload_t *map) {
+	char *topic = (char *) (rec + 1);
+	char *data = rec->data_len > 0 ? topic + rec->topic_len + 1 : NULL;
+	ps_msg_t *msg = msg_alloc();
+	msg->_ref = 1;
+	msg->flags = rec->flags | PS_FL_STICKY;
+	msg->priority = rec->priority;
+	msg->rtopic = NULL;
+	if (PS_IS_INT(msg)) {
+		msg->int_val = rec->int_val;
+	} else if (PS_IS_DBL(msg)) {
+		msg->dbl_val = rec->dbl_val;
+	} else if (PS_IS_BOOL(msg)) {
+		msg->bool_val = rec->int_val;
+	} else if (PS_IS_STR(msg)) {
+		msg->str_val = data;
+	} else if (PS_IS_BUF(msg)) {
+		msg->buf_val.ptr = data;
+		msg->buf_val.sz = rec->data_len;
+		msg->buf_val.dtor = NULL;
+	} else if (PS_IS_ERR(msg)) {
+		msg->err_val.id = rec->int_val;
+		msg->err_val.desc = data;
+	}
+	if (data != NULL) {
+		__sync_add_and_fetch(&map->ref, 1);
+		msg->_payload = map;
+	}
+	__sync_add_and_fetch(&stat_live_msg, 1);
+	ps_msg_store_topic(msg, topic, rec->topic_len);
+	return msg;
+}
+#endif
+
+int ps_sticky_save(const char *path) {
+#ifdef __linux__
+	sticky_list_t sl = {0};
+	lock_all_shards();
+	collect_sticky(topic_root, &sl);
+	unlock_all_shards();
+
+	size_t size = sizeof(sticky_header_t);
+	for (size_t i = 0; i < sl.count; i++) {
+		uint32_t data_len;
+		sticky_data(sl.msgs[i], &data_len);
+		size += sticky_record_size(ps_msg_topic_len(sl.msgs[i]), data_len);
+	}
+	char *buf = calloc(1, size);
+	*(sticky_header_t *) buf =
+	(sticky_header_t){.magic = STICKY_MAGIC, .version = STICKY_VERSION, .size = size, .count = sl.count};
+	char *p = buf + sizeof(sticky_header_t);
+	for (size_t i = 0; i < sl.count; i++) {
+		p += sticky_record_write(p, sl.msgs[i]);
+		ps_unref_msg(sl.msgs[i]);
+	}
+	free(sl.msgs);
+
+	int ret = write_file(path, buf, size);
+	free(buf);
+	return ret == 0 ? (int) sl.count : -1;
+#else
+	(void) path;
+	return -1;
+#endif
+}
+
+int ps_sticky_load(const char *path) {
+#ifdef __linux__
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	struct stat st;
+	if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(sticky_header_t)) {
+		close(fd);
+		return -1;
+	}
+	size_t size = st.st_size;
+	// Private writable mapping: values are handed to subscribers as if they were owned by the messages
+	char *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED)
+		return -1;
+
+	// Checked before restoring anything, a bad file doesn't leave a partial state
+	sticky_header_t *h = (sticky_header_t *) base;
+	bool valid = h->magic == STICKY_MAGIC && h->version == STICKY_VERSION && h->size == size;
+	size_t off = sizeof(sticky_header_t);
+	for (uint64_t i = 0; valid && i < h->count; i++) {
+		valid = sticky_record_next(base, size, &off) != NULL;
+	}
+	if (!valid || off != size) {
+		munmap(base, size);
+		return -1;
+	}
+
+	sticky_map_t *map = malloc(sizeof(sticky_map_t));
+	map->base = base;
+	map->size = size;
+	msg_payload_t *p = malloc(sizeof(msg_payload_t));
+	p->ref = 1;
+	p->ptr = map;
+	p->dtor = sticky_unmap;
+	uint64_t count = h->count;
+	off = sizeof(sticky_header_t);
+	for (uint64_t i = 0; i < count; i++) {
+		ps_publish(sticky_record_msg(sticky_record_next(base, size, &off), p));
+	}
+	msg_payload_unref(p);
+	return count;
+#else
+	(void) path;
+	return -1;
+#endif
+}
+
+ps_topic_t *ps_topic_get(const char *topic) {
+	if (topic == NULL)
+		return NULL;
+
+	topic_shard_t *sh = topic_shard_of(topic);
+	mutex_lock(sh->lock);
+	topic_map_t *tm = fetch_topic_create_if_not_exist(topic_root, topic);
+	topic_set_name(tm, topic);
+	tm->refs++;
+	mutex_unlock(sh->lock);
+	return tm;
+}
+
+ps_topic_t *ps_topic_ref(ps_topic_t *topic) {
+	if (topic != NULL) {
+		mutex_lock(topic->shard->lock);
+		topic->refs++;
+		mutex_unlock(topic->shard->lock);
+	}
+	return topic;
+}
+
+void ps_topic_unref(ps_topic_t *topic) {
+	if (topic == NULL)
+		return;
+	topic_shard_t *sh = topic->shard;
+	mutex_lock(sh->lock);
+	if (--topic->refs == 0) {
+		prune_topic(topic);
+	}
+	mutex_unlock(sh->lock);
+}
+
+const char *ps_topic_name(const ps_topic_t *topic) {
+	return topic->name->str;
+}
+
+static size_t publish_topic(topic_map_t *tm, ps_msg_t *msg) {
+	size_t ret = 0;
+	subscriber_array_t *sa = subscribers_get(tm);
+	if (sa == NULL) {
+		return 0;
+	}
+	uint32_t count = __atomic_load_n(&sa->count, __ATOMIC_ACQUIRE);
+	for (uint32_t i = 0; i < count; i++) {
+		subscriber_entry_t *se = &sa->entries[i];
+		if (i + SUBSCRIBERS_PREFETCH < count) {
+			__builtin_prefetch(sa->entries[i + SUBSCRIBERS_PREFETCH].su);
+		}
+		uint32_t state = __atomic_load_n(&se->state, __ATOMIC_ACQUIRE);
+		if ((state & SUB_REMOVED) || ((state & SUB_ON_EMPTY) && ps_waiting(se->su) != 0)) {
+			continue;
+		}
+		if (push_subscriber_queue(se->su, msg, state & SUB_PRIO_MASK) == 0 && !(state & SUB_HIDDEN)) {
+			ret++;
+		}
+	}
+	return ret;
+}
+
+/*
+ * Calls fn on the wildcard subscriptions matching a topic. tm is the pattern node matching the topic
+ * segments before seg, which is NULL past the last one. Patterns matching a topic ancestor only count
+ * when recursive. Must be called from a read section.
+ */
+static size_t wildcard_match(topic_map_t *tm, const char *seg, bool recursive, topic_fn_t fn, void *ctx) {
+	size_t ret = 0;
+	if (tm != wildcard_root && (seg == NULL || recursive)) {
+		ret += fn(tm, ctx);
+	}
+	if (seg == NULL || __atomic_load_n(&tm->children, __ATOMIC_ACQUIRE) == NULL) {
+		return ret;
+	}
+	uint32_t hashv;
+	const char *end = topic_segment(seg, &hashv);
+	const char *next = *end == '.' ? end + 1 : NULL;
+	topic_map_t *any = topic_child(tm, "*", 1, wildcard_any_hash);
+	topic_map_t *child = topic_child(tm, seg, end - seg, hashv);
+	if (child != NULL && child != any) {
+		ret += wildcard_match(child, next, recursive, fn, ctx);
+	}
+	if (any != NULL) {
+		ret += wildcard_match(any, next, recursive, fn, ctx);
+	}
+	if ((child = topic_child(tm, "#", 1, wildcard_tail_hash)) != NULL) {
+		ret += fn(child, ctx);
+	}
+	return ret;
+}
+
+static size_t wildcard_match_topic(const char *topic, bool recursive, topic_fn_t fn, void *ctx) {
+	if (*topic == '\0' || *topic == ' ') {
+		return 0; // No pattern matches the root
+	}
+	return wildcard_match(wildcard_root, topic, recursive, fn, ctx);
+}
+
+static size_t publish_topic_fn(topic_map_t *tm, void *ctx) {
+	return publish_topic(tm, ctx);
+}
+
+static size_t publish_wildcards(const char *topic, ps_msg_t *msg) {
+	return wildcard_match_topic(topic, !(msg->flags & PS_FL_NONRECURSIVE), publish_topic_fn, msg);
+}
+
+// Calls fn on tm, if it is the node of the topic, and on its ancestors if recursive. Must be called from a read
+// section.
+static size_t topic_chain(topic_map_t *tm, bool exact, bool recursive, topic_fn_t fn, void *ctx) {
+	size_t ret = 0;
+	if (exact) {
+		ret += fn(tm, ctx);
+		tm = tm->parent;
+	}
+	if (recursive) {
+		for (; tm != NULL; tm = tm->parent) {
+			ret += fn(tm, ctx);
+		}
+	}
+	return ret;
+}
+
+static size_t publish_chain(topic_map_t *tm, bool exact, ps_msg_t *msg) {
+	return topic_chain(tm, exact, !(msg->flags & PS_FL_NONRECURSIVE), publish_topic_fn, msg);
+}
+
+static size_t interest_fn(topic_map_t *tm, void *ctx) {
+	(void) ctx;
+	return subscribers_get(tm) != NULL;
+}
+
+// Tells whether publishing to topic would have any effect, tm is its node if exact. Must be called from a read section.
+static bool topic_interest(topic_map_t *tm, bool exact, const char *topic, uint32_t flags) {
+	if ((flags & PS_FL_STICKY) || (exact && __atomic_load_n(&tm->sticky, __ATOMIC_ACQUIRE) != NULL)) {
+		return true; // Stores or clears the sticky message
+	}
+	bool recursive = !(flags & PS_FL_NONRECURSIVE);
+	return topic_chain(tm, exact, recursive, interest_fn, NULL) > 0 ||
+	       wildcard_match_topic(topic, recursive, interest_fn, NULL) > 0;
+}
+
+bool ps_has_interest(const char *topic, uint32_t flags) {
+	if (topic == NULL)
+		return false;
+	bool exact;
+	rcu_token_t token = rcu_read_lock();
+	topic_map_t *tm = topic_walk(topic_root, topic, false, &exact);
+	bool ret = topic_interest(tm, exact, topic, flags);
+	rcu_read_unlock(token);
+	return ret;
+}
+
+/*
+ * Publishes msg from the lookup of its topic: tm is either the topic node or its deepest existing
+ * ancestor, found in the read section of token, which is left.
+ */
+static int publish_walked(ps_msg_t *msg, topic_map_t *tm, bool exact, rcu_token_t token) {
+	size_t ret = 0;
+
+	// Publishes that change the sticky state are serialized with the writers of its shard, the rest only read
+	topic_shard_t *sh = NULL;
+	bool locked = (msg->flags & PS_FL_STICKY) != 0;
+	notify_list_t nl;
+	notify_begin(&nl);
+	if (exact && __atomic_load_n(&tm->sticky, __ATOMIC_ACQUIRE) != NULL) {
+		locked = true;
+	}
+	if (locked) {
+		rcu_read_unlock(token);
+		sh = topic_shard_of(msg->topic);
+		mutex_lock(sh->lock);
+		ps_msg_t *old_sticky = NULL;
+		if (msg->flags & PS_FL_STICKY) {
+			tm = topic_walk(topic_root, msg->topic, true, &exact);
+			old_sticky = swap_sticky(tm, ps_ref_msg(msg));
+		} else {
+			tm = topic_walk(topic_root, msg->topic, false, &exact);
+			if (exact && tm->sticky != NULL) {
+				old_sticky = swap_sticky(tm, NULL);
+				prune_topic(tm);
+				tm = topic_walk(topic_root, msg->topic, false, &exact);
 			}
-			topic[n - 1] = 0;
 		}
+		ps_unref_msg(old_sticky);
+		token = rcu_read_lock();
 	}
+	// tm is either the topic node or its deepest existing ancestor
+	ret = publish_chain(tm, exact, msg);
+	ret += publish_wildcards(msg->topic, msg);
+	rcu_read_unlock(token);
+	if (locked) {
+		mutex_unlock(sh->lock);
+	}
+	notify_end(&nl);
 	ps_unref_msg(msg);
-	free(topic);
-	GLOBAL_UNLOCK
 	return ret;
 }
 
-int ps_subs_count(char *topic_) {
-	if (topic_ == NULL || strlen(topic_) == 0)
+int ps_publish(ps_msg_t *msg) {
+	if (msg == NULL)
 		return 0;
-	char *topic = strdup(topic_);
+	bool exact;
+	rcu_token_t token = rcu_read_lock();
+	topic_map_t *tm = topic_walk(topic_root, msg->topic, false, &exact);
+	return publish_walked(msg, tm, exact, token);
+}
 
-	char *fl_str = strchr(topic, ' ');
-	if (fl_str != NULL)
-		*fl_str = '\0';
+// Releases the arguments of a message that is not built, buffers would have been owned by it
+static void discard_vvalue(uint32_t flags, va_list args) {
+	if ((flags & PS_MSK_TYP) == PS_BUF_TYP) {
+		void *ptr = va_arg(args, void *);
+		(void) va_arg(args, size_t);
+		ps_dtor_t dtor = va_arg(args, ps_dtor_t);
+		if (ptr != NULL && dtor != NULL) {
+			dtor(ptr);
+		}
+	}
+}
 
-	topic_map_t *tm = NULL;
-	subscriber_list_t *sl = NULL;
-	size_t count = 0;
+// Publishes the value in args to topic with call_id, the message is only built if someone would receive it
+static int publish_vvalue(const char *topic, uint32_t call_id, uint32_t flags, va_list args) {
+	int ret = 0;
+	if (topic == NULL) {
+		discard_vvalue(flags, args);
+		return 0;
+	}
+	bool exact;
+	rcu_token_t token = rcu_read_lock();
+	topic_map_t *tm = topic_walk(topic_root, topic, false, &exact);
+	if (topic_interest(tm, exact, topic, flags)) {
+		ps_msg_t *msg = ps_new_vmsg(flags, args);
+		ps_msg_store_walked_topic(msg, topic, strlen(topic), tm, exact);
+		msg->call_id = call_id;
+		ret = publish_walked(msg, tm, exact, token);
+	} else {
+		rcu_read_unlock(token);
+		discard_vvalue(flags, args);
+	}
+	return ret;
+}
 
-	GLOBAL_LOCK
-	while (strlen(topic) > 0) {
-		tm = fetch_topic(topic);
-		if (tm != NULL) {
-			DL_FOREACH (tm->subscribers, sl) {
-				if (!sl->hidden)
-					count++;
-			}
+int ps_publish_value(const char *topic, uint32_t flags, ...) {
+	va_list args;
+	va_start(args, flags);
+	int ret = publish_vvalue(topic, 0, flags, args);
+	va_end(args);
+	return ret;
+}
+
+int ps_publish_lazy(const char *topic, uint32_t flags, ps_msg_builder_t builder, void *ctx) {
+	if (topic == NULL || !ps_has_interest(topic, flags))
+		return 0;
+	ps_msg_t *msg = ps_new_msg(topic, (flags & ~PS_MSK_VALUE) | PS_NIL_TYP);
+	builder(msg, ctx);
+	return ps_publish(msg);
+}
+
+int ps_publish_to(ps_topic_t *topic, ps_msg_t *msg) {
+	if (topic == NULL || msg == NULL) {
+		ps_unref_msg(msg);
+		return 0;
+	}
+	size_t ret = 0;
+
+	// Same sticky serialization as ps_publish, the node itself can't go away while the handle is held
+	bool locked = (msg->flags & PS_FL_STICKY) != 0 || __atomic_load_n(&topic->sticky, __ATOMIC_ACQUIRE) != NULL;
+	notify_list_t nl;
+	notify_begin(&nl);
+	if (locked) {
+		mutex_lock(topic->shard->lock);
+		ps_unref_msg(swap_sticky(topic, (msg->flags & PS_FL_STICKY) ? ps_ref_msg(msg) : NULL));
+	}
+	rcu_token_t token = rcu_read_lock();
+	ret = publish_chain(topic, true, msg);
+	ret += publish_wildcards(topic->name->str, msg);
+	rcu_read_unlock(token);
+	if (locked) {
+		mutex_unlock(topic->shard->lock);
+	}
+	notify_end(&nl);
+	ps_unref_msg(msg);
+	return ret;
+}
+
+int ps_publish_value_to(ps_topic_t *topic, uint32_t flags, ...) {
+	int ret = 0;
+	va_list args;
+	va_start(args, flags);
+	bool interest = false;
+	if (topic != NULL) {
+		rcu_token_t token = rcu_read_lock();
+		interest = topic_interest(topic, true, topic->name->str, flags);
+		rcu_read_unlock(token);
+	}
+	if (interest) {
+		ps_msg_t *msg = ps_new_vmsg(flags, args);
+		__sync_add_and_fetch(&topic->name->ref, 1);
+		ps_msg_share_topic(msg, topic->name);
+		ret = ps_publish_to(topic, msg);
+	} else {
+		discard_vvalue(flags, args);
+	}
+	va_end(args);
+	return ret;
+}
+
+typedef struct delivery_s {
+	ps_subscriber_t *su;
+	ps_msg_t *msg;
+	size_t seq;
+	uint8_t priority;
+	bool hidden;
+} delivery_t;
+
+// Deliveries of a batch publish, pushed grouped by subscriber
+typedef struct batch_s {
+	delivery_t *items;
+	size_t count;
+	size_t size;
+	bool sorted;   // Items already grouped by subscriber
+	ps_msg_t *msg; // Message being routed
+	// Scratch space for the queue pushes, allocated along with items
+	ps_msg_t **msgs;
+	int *results;
+	uint8_t *priorities;
+} batch_t;
+
+static void batch_grow(batch_t *b, size_t size) {
+	char *mem = malloc(size * (sizeof(delivery_t) + sizeof(ps_msg_t *) + sizeof(int) + sizeof(uint8_t)));
+	if (b->count > 0) {
+		memcpy(mem, b->items, b->count * sizeof(delivery_t));
+	}
+	free(b->items);
+	b->items = (delivery_t *) mem;
+	b->msgs = (ps_msg_t **) (b->items + size);
+	b->results = (int *) (b->msgs + size);
+	b->priorities = (uint8_t *) (b->results + size);
+	b->size = size;
+}
+
+static size_t batch_topic(topic_map_t *tm, void *ctx) {
+	batch_t *b = ctx;
+	subscriber_array_t *sa = subscribers_get(tm);
+	if (sa == NULL) {
+		return 0;
+	}
+	uint32_t count = __atomic_load_n(&sa->count, __ATOMIC_ACQUIRE);
+	for (uint32_t i = 0; i < count; i++) {
+		subscriber_entry_t *se = &sa->entries[i];
+		uint32_t state = __atomic_load_n(&se->state, __ATOMIC_ACQUIRE);
+		if (state & SUB_REMOVED) {
+			continue;
+		}
+		// Deliveries already batched count as queued
+		if ((state & SUB_ON_EMPTY) &&
+		    (ps_waiting(se->su) != 0 || __atomic_load_n(&se->su->batched, __ATOMIC_RELAXED) != 0)) {
+			continue;
 		}
+		if (b->count == b->size) {
+			batch_grow(b, b->size * 2);
+		}
+		if (b->count > 0 && b->items[b->count - 1].su > se->su) {
+			b->sorted = false;
+		}
+		b->items[b->count] = (delivery_t){.su = se->su,
+		                                  .msg = b->msg,
+		                                  .seq = b->count,
+		                                  .priority = state & SUB_PRIO_MASK,
+		                                  .hidden = (state & SUB_HIDDEN) != 0};
+		b->count++;
+		__atomic_add_fetch(&se->su->batched, 1, __ATOMIC_RELAXED);
+	}
+	return 0;
+}
+
+static int delivery_cmp(const void *a, const void *b) {
+	const delivery_t *da = a, *db = b;
+	if (da->su != db->su) {
+		return (uintptr_t) da->su < (uintptr_t) db->su ? -1 : 1;
+	}
+	return da->seq < db->seq ? -1 : da->seq > db->seq;
+}
 
-		for (size_t n = strlen(topic); n > 0; n--) {
-			if (topic[n - 1] == '.') {
-				topic[n - 1] = 0;
+// Pushes the pending deliveries, one queue operation per subscriber. Must be called from a read section.
+static size_t batch_flush(batch_t *b) {
+	size_t ret = 0;
+	ps_msg_t **msgs = b->msgs;
+	uint8_t *priorities = b->priorities;
+	int *results = b->results;
+
+	if (!b->sorted) {
+		qsort(b->items, b->count, sizeof(delivery_t), delivery_cmp);
+	}
+	for (size_t i = 0, j; i < b->count; i = j) {
+		ps_subscriber_t *su = b->items[i].su;
+		for (j = i; j < b->count && b->items[j].su == su; j++) {
+			msgs[j - i] = ps_ref_msg(b->items[j].msg);
+			priorities[j - i] = b->items[j].priority;
+		}
+		size_t pushed = ps_queue_push_many(su->q, msgs, priorities, results, j - i);
+		__atomic_sub_fetch(&su->batched, j - i, __ATOMIC_RELAXED);
+		for (size_t k = 0; k < j - i; k++) {
+			switch (results[k]) {
+			case PS_QUEUE_EFULL:
+				if (su->spill != NULL) {
+					su->spill(su, msgs[k]);
+					ret += !b->items[i + k].hidden;
+					break;
+				}
+				ps_unref_msg(msgs[k]);
+			// fallthrough
+			case PS_QUEUE_EOVERFLOW:
+				__sync_add_and_fetch(&su->overflow, 1);
 				break;
+			default:
+				if (!b->items[i + k].hidden) {
+					ret++;
+				}
 			}
-			topic[n - 1] = 0;
+		}
+		if (pushed == 0) {
+			continue;
+		}
+
+		notify_pushed(su, pushed);
+	}
+	b->count = 0;
+	b->sorted = true;
+	return ret;
+}
+
+int ps_publish_batch(ps_msg_t **msgs, size_t n) {
+	size_t ret = 0;
+	batch_t b = {.sorted = true};
+	batch_grow(&b, n < 16 ? 16 : n);
+
+	notify_list_t nl;
+	notify_begin(&nl);
+	rcu_token_t token = rcu_read_lock();
+	for (size_t i = 0; i < n; i++) {
+		ps_msg_t *msg = msgs[i];
+		if (msg == NULL) {
+			continue;
+		}
+		bool exact;
+		bool recursive = !(msg->flags & PS_FL_NONRECURSIVE);
+		topic_map_t *tm = topic_walk(topic_root, msg->topic, false, &exact);
+		if ((msg->flags & PS_FL_STICKY) || (exact && __atomic_load_n(&tm->sticky, __ATOMIC_ACQUIRE) != NULL)) {
+			// Sticky changes take the shard lock, which can't be taken from a read section
+			ret += batch_flush(&b);
+			rcu_read_unlock(token);
+			ret += ps_publish(ps_ref_msg(msg));
+			token = rcu_read_lock();
+			continue;
+		}
+		b.msg = msg;
+		topic_chain(tm, exact, recursive, batch_topic, &b);
+		wildcard_match_topic(msg->topic, recursive, batch_topic, &b);
+	}
+	ret += batch_flush(&b);
+	rcu_read_unlock(token);
+	notify_end(&nl);
+
+	for (size_t i = 0; i < n; i++) {
+		ps_unref_msg(msgs[i]);
+	}
+	free(b.items);
+	return ret;
+}
+
+static size_t count_topic(topic_map_t *tm, void *ctx) {
+	(void) ctx; // unused
+	subscriber_array_t *sa = subscribers_get(tm);
+	size_t count = 0;
+	if (sa != NULL) {
+		uint32_t n = __atomic_load_n(&sa->count, __ATOMIC_ACQUIRE);
+		for (uint32_t i = 0; i < n; i++) {
+			if (!(__atomic_load_n(&sa->entries[i].state, __ATOMIC_RELAXED) & (SUB_HIDDEN | SUB_REMOVED)))
+				count++;
 		}
 	}
-	free(topic);
-	GLOBAL_UNLOCK
 	return count;
 }
 
+int ps_subs_count(char *topic) {
+	if (topic == NULL)
+		return 0;
+
+	topic_map_t *tm = NULL;
+	size_t count = 0;
+	bool exact;
+
+	rcu_token_t token = rcu_read_lock();
+	for (tm = topic_walk(topic_root, topic, false, &exact); tm != topic_root; tm = tm->parent) {
+		count += count_topic(tm, NULL);
+	}
+	count += wildcard_match_topic(topic, true, count_topic, NULL);
+	rcu_read_unlock(token);
+	return count;
+}
+
+static void call_chan_subscribe(call_chan_t *ch, size_t queue_size) {
+	ch->queue_size = queue_size;
+	ch->su = subscriber_new(queue_size);
+	ps_subscribe(ch->su, ch->rtopic);
+}
+
+static call_chan_t *call_chan_new(size_t queue_size) {
+	call_chan_t *ch = calloc(1, sizeof(call_chan_t));
+	snprintf(ch->rtopic, sizeof(ch->rtopic), "$r.%u", __sync_add_and_fetch(&uuid_ctr, 1));
+	call_chan_subscribe(ch, queue_size);
+	return ch;
+}
+
+static void call_chan_free(call_chan_t *ch) {
+	subscriber_free(ch->su);
+	free(ch);
+}
+
+// Unregisters and frees the channel of a thread that exits
+static void call_chan_exit(void *v) {
+	call_chan_t *ch = v;
+	mutex_lock(calls_lock);
+	for (call_chan_t **p = &call_chans; *p != NULL; p = &(*p)->next) {
+		if (*p == ch) {
+			*p = ch->next;
+			break;
+		}
+	}
+	mutex_unlock(calls_lock);
+	call_chan_free(ch);
+}
+
+// Returns the channel of this thread with room for queue_size replies, or a temporary one if it is busy
+static call_chan_t *call_chan_get(size_t queue_size) {
+	uint32_t gen = __atomic_load_n(&call_chan_gen, __ATOMIC_ACQUIRE);
+	if (call_chan == NULL || call_chan_gen_local != gen) {
+		call_chan_t *ch = call_chan_new(queue_size);
+		mutex_lock(calls_lock);
+		ch->next = call_chans;
+		call_chans = ch;
+		mutex_unlock(calls_lock);
+		if (call_chan_key != NULL) {
+			thread_key_set(call_chan_key, ch);
+		}
+		call_chan = ch;
+		call_chan_gen_local = gen;
+	}
+	if (call_chan->busy) {
+		return call_chan_new(queue_size);
+	}
+	if (call_chan->queue_size < queue_size) {
+		subscriber_free(call_chan->su);
+		call_chan_subscribe(call_chan, queue_size);
+	}
+	call_chan->busy = true;
+	return call_chan;
+}
+
+static void call_chan_put(call_chan_t *ch) {
+	if (ch == call_chan) {
+		ch->busy = false;
+	} else {
+		call_chan_free(ch);
+	}
+}
+
+static int64_t now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Waits for up to max replies to the current call of ch, dropping the late replies of earlier calls. Replies without
+// call id can't be told apart and are taken.
+static size_t call_wait_replies(call_chan_t *ch, ps_msg_t **replies, size_t max, int64_t timeout) {
+	size_t n = 0;
+	int64_t deadline = timeout > 0 ? now_ms() + timeout : 0;
+	while (n < max) {
+		ps_msg_t *msg = ps_get(ch->su, timeout);
+		if (msg == NULL) {
+			break;
+		}
+		if (msg->call_id == ch->seq || msg->call_id == 0) {
+			replies[n++] = msg;
+		} else {
+			ps_unref_msg(msg);
+		}
+		if (timeout > 0) {
+			timeout = deadline - now_ms();
+			if (timeout < 0)
+				timeout = 0;
+		}
+	}
+	return n;
+}
+
+// Publishes msg as the next call of ch, returns the number of subscribers it was delivered to
+static int call_chan_publish(call_chan_t *ch, ps_msg_t *msg) {
+	ps_flush(ch->su);
+	if (++ch->seq == 0)
+		ch->seq = 1;
+	msg->call_id = ch->seq;
+	ps_msg_set_rtopic(msg, ch->rtopic);
+	return ps_publish(msg);
+}
+
 ps_msg_t *ps_call(ps_msg_t *msg, int64_t timeout) {
 	ps_msg_t *ret_msg = NULL;
-	char rtopic[32] = {0};
+	call_chan_t *ch = call_chan_get(CALL_QUEUE_SIZE);
 
-	snprintf(rtopic, sizeof(rtopic), "$r.%u", __sync_add_and_fetch(&uuid_ctr, 1));
-	ps_msg_set_rtopic(msg, rtopic);
-	ps_subscriber_t *su = ps_new_subscriber(1, PS_STRLIST(rtopic));
-	if (ps_publish(msg) == 0) {
-		goto exit_fn;
+	if (call_chan_publish(ch, msg) > 0) {
+		call_wait_replies(ch, &ret_msg, 1, timeout);
 	}
-	ret_msg = ps_get(su, timeout);
-exit_fn:
-	ps_free_subscriber(su);
+	call_chan_put(ch);
 	return ret_msg;
 }
 
+size_t ps_call_all(ps_msg_t *msg, int64_t timeout, ps_msg_t **replies, size_t max_replies) {
+	call_chan_t *ch = call_chan_get(max_replies + CALL_QUEUE_SIZE);
+	size_t n = 0;
+
+	// No more replies than receivers are expected
+	size_t expected = call_chan_publish(ch, msg);
+	if (expected > max_replies) {
+		expected = max_replies;
+	}
+	if (expected > 0) {
+		n = call_wait_replies(ch, replies, expected, timeout);
+	}
+	call_chan_put(ch);
+	return n;
+}
+
+int ps_reply(ps_msg_t *msg, ps_msg_t *reply) {
+	if (msg == NULL || msg->rtopic == NULL || reply == NULL) {
+		ps_unref_msg(reply);
+		return 0;
+	}
+	ps_msg_set_topic(reply, msg->rtopic);
+	reply->call_id = msg->call_id;
+	return ps_publish(reply);
+}
+
+int ps_reply_value(ps_msg_t *msg, uint32_t flags, ...) {
+	va_list args;
+	va_start(args, flags);
+	int ret = publish_vvalue(msg != NULL ? msg->rtopic : NULL, msg != NULL ? msg->call_id : 0, flags, args);
+	va_end(args);
+	return ret;
+}
+
+static void call_heap_swap(call_service_t *cs, uint32_t a, uint32_t b) {
+	uint32_t slot = cs->heap[a];
+	cs->heap[a] = cs->heap[b];
+	cs->heap[b] = slot;
+	cs->slots[cs->heap[a]].heap = a;
+	cs->slots[cs->heap[b]].heap = b;
+}
+
+static bool call_heap_less(call_service_t *cs, uint32_t a, uint32_t b) {
+	return cs->slots[cs->heap[a]].deadline < cs->slots[cs->heap[b]].deadline;
+}
+
+static void call_heap_fix(call_service_t *cs, uint32_t i) {
+	while (i > 0 && call_heap_less(cs, i, (i - 1) / 2)) {
+		call_heap_swap(cs, i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+	for (;;) {
+		uint32_t min = i;
+		uint32_t l = 2 * i + 1;
+		if (l < cs->heap_count && call_heap_less(cs, l, min))
+			min = l;
+		if (l + 1 < cs->heap_count && call_heap_less(cs, l + 1, min))
+			min = l + 1;
+		if (min == i)
+			break;
+		call_heap_swap(cs, i, min);
+		i = min;
+	}
+}
+
+// Takes a call out of the service, returns a copy of it. The lock must be held.
+static pending_call_t call_service_take(call_service_t *cs, uint32_t slot) {
+	pending_call_t *pc = &cs->slots[slot];
+	pending_call_t ret = *pc;
+	if (pc->heap != UINT32_MAX) {
+		uint32_t i = pc->heap;
+		cs->heap_count--;
+		if (i != cs->heap_count) {
+			call_heap_swap(cs, i, cs->heap_count);
+			call_heap_fix(cs, i);
+		}
+	}
+	pc->seq = 0;
+	cs->count--;
+	return ret;
+}
+
+// Doubles the slots, every call moves to the slot of its id. The lock must be held.
+static void call_service_grow(call_service_t *cs) {
+	uint32_t n = cs->nslots != 0 ? cs->nslots * 2 : 16;
+	pending_call_t *slots = calloc(n, sizeof(pending_call_t));
+	for (uint32_t i = 0; i < cs->nslots; i++) {
+		pending_call_t *pc = &cs->slots[i];
+		if (pc->seq != 0) {
+			uint32_t slot = pc->seq & (n - 1);
+			slots[slot] = *pc;
+			if (pc->heap != UINT32_MAX)
+				cs->heap[pc->heap] = slot;
+		}
+	}
+	free(cs->slots);
+	cs->slots = slots;
+	cs->heap = realloc(cs->heap, n * sizeof(uint32_t));
+	cs->nslots = n;
+}
+
+// Returns the slot of the call a reply belongs to, UINT32_MAX if it is late or not a reply. The lock must be held.
+static uint32_t call_service_match(call_service_t *cs, ps_msg_t *msg) {
+	if (msg->call_id == 0 || cs->nslots == 0)
+		return UINT32_MAX;
+	uint32_t slot = msg->call_id & (cs->nslots - 1);
+	return cs->slots[slot].seq == msg->call_id ? slot : UINT32_MAX;
+}
+
+// Completes the calls the replies in msgs belong to and drops the rest. The lock must be held.
+static void call_service_reply(call_service_t *cs, ps_msg_t **msgs, size_t n) {
+	for (size_t i = 0; i < n; i++) {
+		uint32_t slot = call_service_match(cs, msgs[i]);
+		if (slot != UINT32_MAX) {
+			pending_call_t pc = call_service_take(cs, slot);
+			mutex_unlock(cs->lock);
+			pc.cb(msgs[i], pc.ctx);
+			mutex_lock(cs->lock);
+		}
+		ps_unref_msg(msgs[i]);
+	}
+}
+
+static void call_service_notify(void *ctx) {
+	call_service_t *cs = ctx;
+	semaphore_post(cs->wake);
+}
+
+static void call_service_spill(ps_subscriber_t *su, ps_msg_t *msg) {
+	call_service_t *cs = su->userData;
+	mutex_lock(cs->lock);
+	if (cs->spilled_count == cs->spilled_size) {
+		cs->spilled_size = cs->spilled_size != 0 ? cs->spilled_size * 2 : CALL_SERVICE_BATCH;
+		cs->spilled = realloc(cs->spilled, cs->spilled_size * sizeof(ps_msg_t *));
+	}
+	cs->spilled[cs->spilled_count++] = msg;
+	mutex_unlock(cs->lock);
+	semaphore_post(cs->wake);
+}
+
+// Takes the queued and the spilled replies. The lock must be held.
+static void call_service_drain(call_service_t *cs) {
+	ps_msg_t *msgs[CALL_SERVICE_BATCH];
+	size_t n;
+	do {
+		mutex_unlock(cs->lock);
+		n = ps_get_many(cs->su, msgs, CALL_SERVICE_BATCH, 0);
+		mutex_lock(cs->lock);
+		call_service_reply(cs, msgs, n);
+	} while (n == CALL_SERVICE_BATCH);
+	while (cs->spilled_count > 0) {
+		n = cs->spilled_count < CALL_SERVICE_BATCH ? cs->spilled_count : CALL_SERVICE_BATCH;
+		cs->spilled_count -= n;
+		memcpy(msgs, cs->spilled + cs->spilled_count, n * sizeof(ps_msg_t *));
+		call_service_reply(cs, msgs, n);
+	}
+}
+
+static void call_service_run(void *arg) {
+	call_service_t *cs = arg;
+
+	mutex_lock(cs->lock);
+	while (!cs->stop) {
+		int64_t now = now_ms();
+		while (cs->heap_count > 0 && cs->slots[cs->heap[0]].deadline <= now) {
+			pending_call_t pc = call_service_take(cs, cs->heap[0]);
+			mutex_unlock(cs->lock);
+			pc.cb(NULL, pc.ctx);
+			mutex_lock(cs->lock);
+		}
+		int64_t timeout = -1;
+		cs->wait_until = INT64_MAX;
+		if (cs->heap_count > 0) {
+			cs->wait_until = cs->slots[cs->heap[0]].deadline;
+			timeout = cs->wait_until - now < INT32_MAX ? cs->wait_until - now : INT32_MAX;
+		}
+		mutex_unlock(cs->lock);
+
+		semaphore_wait(cs->wake, timeout);
+
+		mutex_lock(cs->lock);
+		cs->wait_until = INT64_MIN;
+		call_service_drain(cs);
+	}
+	mutex_unlock(cs->lock);
+}
+
+static call_service_t *call_service_get(void) {
+	call_service_t *cs = __atomic_load_n(&call_service, __ATOMIC_ACQUIRE);
+	if (cs != NULL)
+		return cs;
+	mutex_lock(calls_lock);
+	cs = call_service;
+	if (cs == NULL) {
+		cs = calloc(1, sizeof(call_service_t));
+		mutex_init(&cs->lock);
+		semaphore_init(&cs->wake, 0);
+		cs->wait_until = INT64_MIN;
+		snprintf(cs->rtopic, sizeof(cs->rtopic), "$r.%u", __sync_add_and_fetch(&uuid_ctr, 1));
+		cs->su = subscriber_new(CALL_SERVICE_QUEUE_SIZE);
+		cs->su->userData = cs;
+		cs->su->spill = call_service_spill;
+		ps_queue_set_notify(cs->su->q, call_service_notify, cs);
+		ps_subscribe(cs->su, cs->rtopic);
+		if (thread_create(&cs->thread, call_service_run, cs) == 0) {
+			__atomic_store_n(&call_service, cs, __ATOMIC_RELEASE);
+		} else {
+			subscriber_free(cs->su);
+			semaphore_destroy(&cs->wake);
+			mutex_destroy(&cs->lock);
+			free(cs);
+			cs = NULL; // The next call tries again
+		}
+	}
+	mutex_unlock(calls_lock);
+	return cs;
+}
+
+// Stops the call thread, the calls still in flight complete with no reply
+static void call_service_free(call_service_t *cs) {
+	mutex_lock(cs->lock);
+	cs->stop = true;
+	mutex_unlock(cs->lock);
+	semaphore_post(cs->wake);
+	thread_join(&cs->thread);
+	for (uint32_t i = 0; i < cs->nslots; i++) {
+		if (cs->slots[i].seq != 0)
+			cs->slots[i].cb(NULL, cs->slots[i].ctx);
+	}
+	subscriber_free(cs->su);
+	for (size_t i = 0; i < cs->spilled_count; i++) {
+		ps_unref_msg(cs->spilled[i]);
+	}
+	free(cs->spilled);
+	semaphore_destroy(&cs->wake);
+	mutex_destroy(&cs->lock);
+	free(cs->slots);
+	free(cs->heap);
+	free(cs);
+}
+
+static void calls_free(void) {
+	if (call_service != NULL) {
+		call_service_free(call_service);
+		call_service = NULL;
+	}
+	while (call_chans != NULL) {
+		call_chan_t *ch = call_chans;
+		call_chans = ch->next;
+		call_chan_free(ch);
+	}
+	__atomic_add_fetch(&call_chan_gen, 1, __ATOMIC_RELEASE);
+}
+
+int ps_call_async(ps_msg_t *msg, int64_t timeout, ps_call_cb_t cb, void *ctx) {
+	call_service_t *cs = call_service_get();
+
+	if (cs == NULL) {
+		ps_unref_msg(msg);
+		cb(NULL, ctx);
+		return -1;
+	}
+
+	mutex_lock(cs->lock);
+	if (cs->count * 2 >= cs->nslots)
+		call_service_grow(cs);
+	// Skips the ids whose slot is taken by a call still in flight
+	do {
+		if (++cs->seq == 0)
+			cs->seq = 1;
+	} while (cs->slots[cs->seq & (cs->nslots - 1)].seq != 0);
+	uint32_t seq = cs->seq;
+	uint32_t slot = seq & (cs->nslots - 1);
+	pending_call_t *pc = &cs->slots[slot];
+	*pc = (pending_call_t){.seq = seq, .heap = UINT32_MAX, .cb = cb, .ctx = ctx};
+	cs->count++;
+	bool wake = false;
+	if (timeout >= 0) {
+		pc->deadline = now_ms() + timeout;
+		pc->heap = cs->heap_count;
+		cs->heap[cs->heap_count++] = slot;
+		call_heap_fix(cs, pc->heap);
+		wake = pc->deadline < cs->wait_until; // The thread sleeps past it
+	}
+	mutex_unlock(cs->lock);
+
+	msg->call_id = seq;
+	ps_msg_set_rtopic(msg, cs->rtopic);
+	if (wake) {
+		semaphore_post(cs->wake);
+	}
+	int ret = ps_publish(msg);
+	if (ret == 0) {
+		// Nobody will reply, complete it now unless the thread already timed it out
+		mutex_lock(cs->lock);
+		bool pending = cs->slots[slot].seq == seq;
+		if (pending)
+			call_service_take(cs, slot);
+		mutex_unlock(cs->lock);
+		if (pending)
+			cb(NULL, ctx);
+	}
+	return ret;
+}
+
+struct ps_call_s {
+	semaphore_t done;
+	ps_msg_t *reply;
+};
+
+static void call_future_done(ps_msg_t *reply, void *ctx) {
+	ps_call_t *call = ctx;
+	call->reply = ps_ref_msg(reply);
+	semaphore_post(call->done);
+}
+
+ps_call_t *ps_call_start(ps_msg_t *msg, int64_t timeout) {
+	ps_call_t *call = calloc(1, sizeof(ps_call_t));
+	semaphore_init(&call->done, 0);
+	ps_call_async(msg, timeout, call_future_done, call);
+	return call;
+}
+
+ps_msg_t *ps_call_wait(ps_call_t *call) {
+	semaphore_wait(call->done, -1);
+	ps_msg_t *reply = call->reply;
+	semaphore_destroy(&call->done);
+	free(call);
+	return reply;
+}
+
 ps_msg_t *ps_wait_one(const char *topic, int64_t timeout) {
 	ps_msg_t *ret_msg = NULL;
 
@@ -707,10 +3346,9 @@ bool ps_has_topic_prefix(ps_msg_t *msg, const char *pre) {
 	}
 
 	// compare with strlen(pre) or length until flags
-	char *fl_str = strchr(pre, ' ');
-	size_t len = fl_str == NULL ? strlen(pre) : (size_t) (fl_str - pre);
+	size_t len = topic_len(pre);
 
-	return strncmp(pre, msg->topic, len) == 0;
+	return len <= ps_msg_topic_len(msg) && memcmp(pre, msg->topic, len) == 0;
 }
 
 bool ps_has_topic_suffix(ps_msg_t *msg, const char *suf) {
@@ -718,12 +3356,12 @@ bool ps_has_topic_suffix(ps_msg_t *msg, const char *suf) {
 		return false;
 	}
 	size_t lsuf = strlen(suf);
-	size_t ltopic = strlen(msg->topic);
+	size_t ltopic = ps_msg_topic_len(msg);
 	if (lsuf > ltopic) {
 		return false;
 	}
 
-	return strcmp(suf, &msg->topic[ltopic - lsuf]) == 0;
+	return memcmp(suf, &msg->topic[ltopic - lsuf], lsuf) == 0;
 }
 
 bool ps_has_topic(ps_msg_t *msg, const char *topic) {
@@ -731,9 +3369,8 @@ bool ps_has_topic(ps_msg_t *msg, const char *topic) {
 		return false;
 	}
 
-	// compare with strlen(pre) or length until flags
-	char *fl_str = strchr(topic, ' ');
-	size_t len = fl_str == NULL ? strlen(topic) : (size_t) (fl_str - topic);
+	// compare with strlen(topic) or length until flags
+	size_t len = topic_len(topic);
 
-	return strncmp(topic, msg->topic, len) == 0;
+	return len <= ps_msg_topic_len(msg) && memcmp(topic, msg->topic, len) == 0;
 }
@@ -20,6 +20,10 @@
 #define PS_QUEUE_BUCKET
 #endif
 
+#ifndef PS_TOPIC_SHARDS
+#define PS_TOPIC_SHARDS 8 // Default number of independently locked topic map shards
+#endif
+
 /**
  * @brief Flags associated to the message:
  * PS_FL_STICKY: Stores the las message sent to the topic and automatically publish it to new subscribers to that topic.
@@ -84,11 +88,15 @@ typedef struct ps_err_s {
 } ps_err_t;
 
 typedef struct ps_msg_s {
-	uint32_t _ref; // Ref counter
-	char *topic;   // Message topic
-	char *rtopic;  // Response topic
+	uint32_t _ref;    // Ref counter
+	uint32_t call_id; // Call of the message, carried from a request to its responses by ps_reply (0 = none)
+	char *topic;      // Message topic
+	char *rtopic;     // Response topic
 	uint32_t flags;
 	int8_t priority;
+	uint8_t _fl;         // Private flags
+	uint16_t _topic_len; // Topic length, UINT16_MAX if it doesn't fit
+	void *_payload;      // Payload shared with duplicates
 	union {
 		double dbl_val;
 		int64_t int_val;
@@ -109,9 +117,20 @@ typedef struct ps_sub_flags_s {
 } ps_sub_flags_t;
 
 typedef struct ps_subscriber_s ps_subscriber_t; // Private definition
+typedef struct ps_topic_s ps_topic_t;           // Private definition
+typedef struct ps_dispatcher_s ps_dispatcher_t; // Private definition
+typedef struct ps_call_s ps_call_t;             // Private definition
+
+typedef struct ps_opts_s {
+	size_t shards; // Number of topic map shards, 0 = PS_TOPIC_SHARDS
+	bool msg_pool; // Recycle messages through per-thread caches instead of malloc/free
+} ps_opts_t;
 
 typedef void (*ps_new_msg_cb_t)(ps_subscriber_t *);
 typedef void (*ps_non_empty_cb_t)(ps_subscriber_t *);
+typedef void (*ps_handler_t)(ps_subscriber_t *, ps_msg_t *);
+typedef void (*ps_msg_builder_t)(ps_msg_t *, void *);
+typedef void (*ps_call_cb_t)(ps_msg_t *, void *);
 
 #ifndef PS_DEPRECATE_NO_PREFIX
 typedef ps_strlist_t ps_strlist_t;
@@ -125,6 +144,13 @@ typedef ps_non_empty_cb_t non_empty_cb_t;
  */
 void ps_init(void);
 
+/**
+ * @brief ps_init_opts initializes the publish/subscribe internal context with custom options.
+ *
+ * @param opts options, NULL for defaults
+ */
+void ps_init_opts(const ps_opts_t *opts);
+
 /**
  * @brief ps_init deinitializes the publish/subscribe internal context.
  */
@@ -140,8 +166,21 @@ void ps_deinit(void);
  */
 ps_msg_t *ps_new_msg(const char *topic, uint32_t flags, ...);
 
+/**
+ * @brief ps_new_msg_to creates a new message for a topic handle. The message shares the topic
+ * string of the handle instead of copying it.
+ *
+ * @param topic handle returned by ps_topic_get
+ * @param flags for specifying the message type.
+ * @param ... values (Depends on flags)
+ * @return ps_msg_t
+ */
+ps_msg_t *ps_new_msg_to(ps_topic_t *topic, uint32_t flags, ...);
+
 /**
  * @brief ps_dup_msg duplicates message
+ * String and owned buffer (with dtor) payloads are shared with the duplicate instead of copied, so they must not
+ * be modified in place. ps_msg_set_value replaces the value of one copy without affecting the other.
  *
  * @param msg_orig message to duplicate
  * @return ps_msg_t
@@ -304,6 +343,17 @@ void *ps_subscriber_user_data(ps_subscriber_t *s);
  */
 ps_msg_t *ps_get(ps_subscriber_t *su, int64_t timeout);
 
+/**
+ * @brief ps_get_many waits for messages and gets up to max of them at once
+ *
+ * @param su subscriber from where to get the messages
+ * @param msgs array where the messages are stored
+ * @param max maximum number of messages to get
+ * @param timeout in miliseconds to wait for the first message (-1 = waits forever, 0 = don't block).
+ * @return the number of messages stored in msgs, 0 if timeout reached.
+ */
+size_t ps_get_many(ps_subscriber_t *su, ps_msg_t **msgs, size_t max, int64_t timeout);
+
 /**
  * @brief ps_subscribe adds topic to the subscriber instance
  * @param su subscriber instance
@@ -317,6 +367,10 @@ ps_msg_t *ps_get(ps_subscriber_t *su, int64_t timeout);
  *   * "foo.bar p5": Assigns priority 5 to messages from this topic. 0: lowest priority, 9: highest priority
  *   * "foo.bar s": Do not receive stickied messages
  *   * "foo.bar S": Receive stickied messages from the child topics
+ *
+ * Topic segments can be wildcards:
+ *   * "fleet.*.status": "*" matches any single segment
+ *   * "fleet.#" or "fleet.>": A last "#" or ">" segment matches one or more trailing segments
  */
 int ps_subscribe(ps_subscriber_t *su, const char *topic);
 
@@ -369,6 +423,9 @@ int ps_unsubscribe_all(ps_subscriber_t *su);
 /**
  * @brief ps_set_new_msg_cb set up a callback which is called when there are new messages
  *
+ * Callbacks run in the publishing thread once the publish has released its internal locks, so they can publish,
+ * (un)subscribe or free their own subscriber.
+ *
  * @param su subscriber instance
  * @param cb callback function pointer
  */
@@ -382,6 +439,59 @@ void ps_set_new_msg_cb(ps_subscriber_t *su, ps_new_msg_cb_t cb);
  */
 void ps_set_non_empty_cb(ps_subscriber_t *su, ps_non_empty_cb_t cb);
 
+/**
+ * @brief ps_subscriber_fd returns a file descriptor that becomes readable when the queue goes from empty to non-empty,
+ * so subscribers can be waited on from poll/epoll loops.
+ *
+ * The descriptor is signaled once per transition, not per message: after it becomes readable, read it to clear it
+ * and then call ps_get(su, 0) until it returns NULL. Wakeups can be spurious. The descriptor is owned by the
+ * subscriber and closed by ps_free_subscriber.
+ *
+ * @param su subscriber instance
+ * @return file descriptor (eventfd) or -1 if not supported or on error
+ */
+int ps_subscriber_fd(ps_subscriber_t *su);
+
+/**
+ * @brief ps_new_dispatcher creates a pool of worker threads that run the handlers of its subscribers
+ *
+ * Runnable subscribers are spread over per-worker queues and idle workers steal from the busy ones. A subscriber
+ * is handled by one worker at a time, so its messages are handled in queue order.
+ *
+ * @param workers number of worker threads
+ * @return dispatcher instance or NULL on error
+ */
+ps_dispatcher_t *ps_new_dispatcher(size_t workers);
+
+/**
+ * @brief ps_free_dispatcher stops and joins the workers. The subscribers still added are removed and go back to
+ * ps_get. It must not be called from a handler.
+ *
+ * @param d dispatcher instance
+ */
+void ps_free_dispatcher(ps_dispatcher_t *d);
+
+/**
+ * @brief ps_dispatcher_add hands the messages of a subscriber to a dispatcher, which calls handler for each of them
+ * from its workers. The message is unreferenced when the handler returns. ps_get must not be used on the subscriber
+ * meanwhile.
+ *
+ * @param d dispatcher instance
+ * @param su subscriber instance
+ * @param handler function called for each message
+ * @return status (-1 = Error, already in a dispatcher, 0 = Ok)
+ */
+int ps_dispatcher_add(ps_dispatcher_t *d, ps_subscriber_t *su, ps_handler_t handler);
+
+/**
+ * @brief ps_dispatcher_remove takes a subscriber out of its dispatcher, waiting for its running handler if any.
+ * ps_free_subscriber does it too. Both can be called from the handler of the subscriber.
+ *
+ * @param su subscriber instance
+ * @return status (-1 = Error, not in a dispatcher, 0 = Ok)
+ */
+int ps_dispatcher_remove(ps_subscriber_t *su);
+
 /**
  * @brief ps_flush clears all messages pending in the queue
  *
@@ -430,15 +540,185 @@ int ps_overflow(ps_subscriber_t *su);
  */
 int ps_publish(ps_msg_t *msg);
 
+/**
+ * @brief ps_has_interest tells whether publishing to a topic would have any effect: the topic, one of its parents
+ * (unless flags has PS_FL_NONRECURSIVE) or a matching wildcard has subscribers, or the publish stores or clears a
+ * sticky message.
+ *
+ * @param topic string path of the topic
+ * @param flags of the message that would be published
+ * @return bool false if the message can be skipped
+ */
+bool ps_has_interest(const char *topic, uint32_t flags);
+
+/**
+ * @brief ps_publish_value builds a message with the same arguments as ps_new_msg and publishes it, but only if
+ * ps_has_interest. Otherwise nothing is allocated and buffers with a dtor are released as the message would have.
+ * The PS_PUB_* macros use it.
+ *
+ * @param topic string path of the topic
+ * @param flags for specifying the message type.
+ * @param ... values (Depends on flags)
+ * @return the number of subscribers the message was delivered to
+ */
+int ps_publish_value(const char *topic, uint32_t flags, ...);
+
+/**
+ * @brief ps_publish_lazy publishes a message whose value is only computed if ps_has_interest. The builder receives
+ * a nil message with topic and flags and sets its value (ps_msg_set_value) and other fields.
+ *
+ * @param topic string path of the topic
+ * @param flags message flags, the value type is set by the builder
+ * @param builder called to fill in the message
+ * @param ctx passed to builder
+ * @return the number of subscribers the message was delivered to
+ */
+int ps_publish_lazy(const char *topic, uint32_t flags, ps_msg_builder_t builder, void *ctx);
+
+/**
+ * @brief ps_publish_batch publishes several messages at once. Routing is resolved in a single pass and
+ * each subscriber receives its share of the batch with one queue operation. Messages are delivered to
+ * every subscriber in the batch order.
+ *
+ * @param msgs message instances
+ * @param n number of messages
+ * @return the number of deliveries of the whole batch
+ */
+int ps_publish_batch(ps_msg_t **msgs, size_t n);
+
+/**
+ * @brief ps_topic_get resolves a topic path into a handle. Publishing through the handle
+ * skips the topic lookup. The handle stays valid until released, even when the topic
+ * loses all its subscribers.
+ *
+ * @param topic string path of the topic
+ * @return ps_topic_t* handle, release it with ps_topic_unref
+ */
+ps_topic_t *ps_topic_get(const char *topic);
+
+/**
+ * @brief ps_topic_ref increments the handle reference counter
+ *
+ * @param topic handle
+ * @return ps_topic_t*
+ */
+ps_topic_t *ps_topic_ref(ps_topic_t *topic);
+
+/**
+ * @brief ps_topic_unref decrements the handle reference counter
+ *
+ * @param topic handle
+ */
+void ps_topic_unref(ps_topic_t *topic);
+
+/**
+ * @brief ps_topic_name returns the topic path of a handle
+ *
+ * @param topic handle
+ * @return const char* topic path
+ */
+const char *ps_topic_name(const ps_topic_t *topic);
+
+/**
+ * @brief ps_publish_to publishes a message to the topic of a handle, ignoring the message topic.
+ * Use ps_new_msg_to to create messages whose topic matches the handle.
+ *
+ * @param topic handle
+ * @param msg message instance
+ * @return the number of subscribers the message was delivered to
+ */
+int ps_publish_to(ps_topic_t *topic, ps_msg_t *msg);
+
+/**
+ * @brief ps_publish_value_to is ps_publish_value for the topic of a handle. The PS_PUB_TO_* macros use it.
+ *
+ * @param topic handle
+ * @param flags for specifying the message type.
+ * @param ... values (Depends on flags)
+ * @return the number of subscribers the message was delivered to
+ */
+int ps_publish_value_to(ps_topic_t *topic, uint32_t flags, ...);
+
 /**
  * @brief ps_call create publishes a message, generate a rtopic and waits for a response.
  *
+ * Each thread keeps a reply subscriber on its rtopic and sets a new call_id in msg for each call. Responses sent with
+ * ps_reply carry it back, so late responses of previous calls are dropped. Responses published straight to rtopic
+ * have no call id and are taken as they come.
+ *
  * @param msg message instance
  * @param timeout timeout in miliseconds to wait for response (-1 = waits forever)
  * @return ps_msg_t* message response or null if timeout expired
  */
 ps_msg_t *ps_call(ps_msg_t *msg, int64_t timeout);
 
+/**
+ * @brief ps_call_all publishes a message like ps_call and collects the responses of all its receivers. It returns when
+ * as many responses as non hidden subscribers received the message (up to max_replies) have arrived, or when the
+ * timeout expires.
+ *
+ * @param msg message instance
+ * @param timeout timeout in miliseconds to wait for the responses (-1 = waits forever)
+ * @param replies array where the responses are stored
+ * @param max_replies size of the replies array
+ * @return the number of responses stored in replies
+ */
+size_t ps_call_all(ps_msg_t *msg, int64_t timeout, ps_msg_t **replies, size_t max_replies);
+
+/**
+ * @brief ps_reply publishes reply as the response to msg: to its rtopic and with its call_id. reply is consumed as in
+ * ps_publish.
+ *
+ * @param msg request message
+ * @param reply response message, its topic is replaced
+ * @return number of subscribers the reply was delivered to, 0 if msg has no rtopic
+ */
+int ps_reply(ps_msg_t *msg, ps_msg_t *reply);
+
+/**
+ * @brief ps_reply_value is ps_publish_value for the response to msg. The PS_REPLY_* macros use it.
+ *
+ * @param msg request message
+ * @param flags for specifying the message type.
+ * @param ... values (Depends on flags)
+ * @return number of subscribers the reply was delivered to, 0 if msg has no rtopic
+ */
+int ps_reply_value(ps_msg_t *msg, uint32_t flags, ...);
+
+/**
+ * @brief ps_call_async publishes a message with a generated rtopic like ps_call, but returns without waiting. cb is
+ * called exactly once with the response, or with NULL if the timeout expires or nobody received the message (in that
+ * case from ps_call_async itself). Responses and timeouts of all threads are handled by a single call thread, so cb
+ * must not block. The response is unreferenced when cb returns. Responses are matched by the call id of msg, so they
+ * must be sent with ps_reply or the PS_REPLY_* macros. Responses are never dropped, even when more arrive than the call
+ * thread keeps up with.
+ *
+ * @param msg message instance
+ * @param timeout timeout in miliseconds to wait for response (-1 = waits forever)
+ * @param cb called with the response
+ * @param ctx passed to cb
+ * @return the number of subscribers the message was delivered to, -1 if the call thread can't be started
+ */
+int ps_call_async(ps_msg_t *msg, int64_t timeout, ps_call_cb_t cb, void *ctx);
+
+/**
+ * @brief ps_call_start publishes a message like ps_call_async and returns a handle to wait for its response with
+ * ps_call_wait, so many calls can be in flight at once.
+ *
+ * @param msg message instance
+ * @param timeout timeout in miliseconds to wait for response (-1 = waits forever)
+ * @return ps_call_t* call handle, to be passed to ps_call_wait
+ */
+ps_call_t *ps_call_start(ps_msg_t *msg, int64_t timeout);
+
+/**
+ * @brief ps_call_wait waits for the response of a call started with ps_call_start and frees the call handle.
+ *
+ * @param call handle returned by ps_call_start
+ * @return ps_msg_t* message response or null if timeout expired
+ */
+ps_msg_t *ps_call_wait(ps_call_t *call);
+
 /**
  * @brief ps_wait_one waits one message without creating the subscriber instace
  *
@@ -479,19 +759,39 @@ int ps_stats_live_msg(void);
 int ps_stats_live_subscribers(void);
 void ps_clean_sticky(const char *prefix);
 
+/**
+ * @brief ps_sticky_save writes all sticky messages to a snapshot file, to be restored by ps_sticky_load after a
+ * restart. Pointer values are skipped. The file is replaced atomically and is only meant to be read by the same build
+ * on the same machine.
+ *
+ * @param path of the snapshot file
+ * @return the number of messages saved or -1 on error or if not supported
+ */
+int ps_sticky_save(const char *path);
+
+/**
+ * @brief ps_sticky_load maps a snapshot written by ps_sticky_save and publishes its messages as sticky. Strings,
+ * buffers and error descriptions are not copied, they point into the mapped file, which is released once none of the
+ * restored messages is referenced. Nothing is restored if the file is not a valid snapshot.
+ *
+ * @param path of the snapshot file
+ * @return the number of messages restored or -1 on error or if not supported
+ */
+int ps_sticky_load(const char *path);
+
 /**
  * @brief PUB_INT_FL PUB_DBL_FL PUB_PTR_FL PUB_STR_FL PUB_BOOL_FL PUB_BUF_FL PUB_ERR_FL are macros for simplifying the
  * publish method of messages with flags
  */
-#define PS_PUB_INT_FL(topic, val, fl) ps_publish(ps_new_msg(topic, (fl) | PS_INT_TYP, (int64_t) (val)))
-#define PS_PUB_DBL_FL(topic, val, fl) ps_publish(ps_new_msg(topic, (fl) | PS_DBL_TYP, (double) (val)))
-#define PS_PUB_PTR_FL(topic, val, fl) ps_publish(ps_new_msg(topic, (fl) | PS_PTR_TYP, (void *) (val)))
-#define PS_PUB_STR_FL(topic, val, fl) ps_publish(ps_new_msg(topic, (fl) | PS_STR_TYP, (char *) (val)))
-#define PS_PUB_BOOL_FL(topic, val, fl) ps_publish(ps_new_msg(topic, (fl) | PS_BOOL_TYP, (int) (val)))
+#define PS_PUB_INT_FL(topic, val, fl) ps_publish_value(topic, (fl) | PS_INT_TYP, (int64_t) (val))
+#define PS_PUB_DBL_FL(topic, val, fl) ps_publish_value(topic, (fl) | PS_DBL_TYP, (double) (val))
+#define PS_PUB_PTR_FL(topic, val, fl) ps_publish_value(topic, (fl) | PS_PTR_TYP, (void *) (val))
+#define PS_PUB_STR_FL(topic, val, fl) ps_publish_value(topic, (fl) | PS_STR_TYP, (char *) (val))
+#define PS_PUB_BOOL_FL(topic, val, fl) ps_publish_value(topic, (fl) | PS_BOOL_TYP, (int) (val))
 #define PS_PUB_BUF_FL(topic, ptr, sz, dtor, fl)                                                                        \
-	ps_publish(ps_new_msg(topic, (fl) | PS_BUF_TYP, (void *) (ptr), (size_t) (sz), (ps_dtor_t) (dtor)));
-#define PS_PUB_ERR_FL(topic, id, desc, fl) ps_publish(ps_new_msg(topic, (fl) | PS_ERR_TYP, (int) (id), (char *) (desc)))
-#define PS_PUB_NIL_FL(topic, fl) ps_publish(ps_new_msg(topic, (fl) | PS_NIL_TYP))
+	ps_publish_value(topic, (fl) | PS_BUF_TYP, (void *) (ptr), (size_t) (sz), (ps_dtor_t) (dtor))
+#define PS_PUB_ERR_FL(topic, id, desc, fl) ps_publish_value(topic, (fl) | PS_ERR_TYP, (int) (id), (char *) (desc))
+#define PS_PUB_NIL_FL(topic, fl) ps_publish_value(topic, (fl) | PS_NIL_TYP)
 
 /**
  * @brief PUB_INT PUB_DBL PUB_PTR PUB_STR PUB_BOOL PUB_BUF PUB_ERR are macros for simplifying the publish method of
@@ -506,6 +806,60 @@ void ps_clean_sticky(const char *prefix);
 #define PS_PUB_ERR(topic, id, desc) PS_PUB_ERR_FL(topic, id, desc, 0)
 #define PS_PUB_NIL(topic) PS_PUB_NIL_FL(topic, 0)
 
+/**
+ * @brief PS_PUB_TO_INT_FL PS_PUB_TO_DBL_FL PS_PUB_TO_PTR_FL PS_PUB_TO_STR_FL PS_PUB_TO_BOOL_FL PS_PUB_TO_BUF_FL
+ * PS_PUB_TO_ERR_FL PS_PUB_TO_NIL_FL are macros for simplifying the publish of messages with flags to a topic handle
+ */
+#define PS_PUB_TO_INT_FL(t, val, fl) ps_publish_value_to(t, (fl) | PS_INT_TYP, (int64_t) (val))
+#define PS_PUB_TO_DBL_FL(t, val, fl) ps_publish_value_to(t, (fl) | PS_DBL_TYP, (double) (val))
+#define PS_PUB_TO_PTR_FL(t, val, fl) ps_publish_value_to(t, (fl) | PS_PTR_TYP, (void *) (val))
+#define PS_PUB_TO_STR_FL(t, val, fl) ps_publish_value_to(t, (fl) | PS_STR_TYP, (char *) (val))
+#define PS_PUB_TO_BOOL_FL(t, val, fl) ps_publish_value_to(t, (fl) | PS_BOOL_TYP, (int) (val))
+#define PS_PUB_TO_BUF_FL(t, ptr, sz, dtor, fl)                                                                         \
+	ps_publish_value_to(t, (fl) | PS_BUF_TYP, (void *) (ptr), (size_t) (sz), (ps_dtor_t) (dtor))
+#define PS_PUB_TO_ERR_FL(t, id, desc, fl) ps_publish_value_to(t, (fl) | PS_ERR_TYP, (int) (id), (char *) (desc))
+#define PS_PUB_TO_NIL_FL(t, fl) ps_publish_value_to(t, (fl) | PS_NIL_TYP)
+
+/**
+ * @brief PS_PUB_TO_INT PS_PUB_TO_DBL PS_PUB_TO_PTR PS_PUB_TO_STR PS_PUB_TO_BOOL PS_PUB_TO_BUF PS_PUB_TO_ERR
+ * PS_PUB_TO_NIL are macros for simplifying the publish of messages without flags to a topic handle
+ */
+#define PS_PUB_TO_INT(t, val) PS_PUB_TO_INT_FL(t, val, 0)
+#define PS_PUB_TO_DBL(t, val) PS_PUB_TO_DBL_FL(t, val, 0)
+#define PS_PUB_TO_PTR(t, val) PS_PUB_TO_PTR_FL(t, val, 0)
+#define PS_PUB_TO_STR(t, val) PS_PUB_TO_STR_FL(t, val, 0)
+#define PS_PUB_TO_BOOL(t, val) PS_PUB_TO_BOOL_FL(t, val, 0)
+#define PS_PUB_TO_BUF(t, ptr, sz, dtor) PS_PUB_TO_BUF_FL(t, ptr, sz, dtor, 0)
+#define PS_PUB_TO_ERR(t, id, desc) PS_PUB_TO_ERR_FL(t, id, desc, 0)
+#define PS_PUB_TO_NIL(t) PS_PUB_TO_NIL_FL(t, 0)
+
+/**
+ * @brief PS_REPLY_INT_FL PS_REPLY_DBL_FL PS_REPLY_PTR_FL PS_REPLY_STR_FL PS_REPLY_BOOL_FL PS_REPLY_BUF_FL
+ * PS_REPLY_ERR_FL PS_REPLY_NIL_FL are macros for simplifying the response with flags to a request message
+ */
+#define PS_REPLY_INT_FL(m, val, fl) ps_reply_value(m, (fl) | PS_INT_TYP, (int64_t) (val))
+#define PS_REPLY_DBL_FL(m, val, fl) ps_reply_value(m, (fl) | PS_DBL_TYP, (double) (val))
+#define PS_REPLY_PTR_FL(m, val, fl) ps_reply_value(m, (fl) | PS_PTR_TYP, (void *) (val))
+#define PS_REPLY_STR_FL(m, val, fl) ps_reply_value(m, (fl) | PS_STR_TYP, (char *) (val))
+#define PS_REPLY_BOOL_FL(m, val, fl) ps_reply_value(m, (fl) | PS_BOOL_TYP, (int) (val))
+#define PS_REPLY_BUF_FL(m, ptr, sz, dtor, fl)                                                                          \
+	ps_reply_value(m, (fl) | PS_BUF_TYP, (void *) (ptr), (size_t) (sz), (ps_dtor_t) (dtor))
+#define PS_REPLY_ERR_FL(m, id, desc, fl) ps_reply_value(m, (fl) | PS_ERR_TYP, (int) (id), (char *) (desc))
+#define PS_REPLY_NIL_FL(m, fl) ps_reply_value(m, (fl) | PS_NIL_TYP)
+
+/**
+ * @brief PS_REPLY_INT PS_REPLY_DBL PS_REPLY_PTR PS_REPLY_STR PS_REPLY_BOOL PS_REPLY_BUF PS_REPLY_ERR PS_REPLY_NIL are
+ * macros for simplifying the response without flags to a request message
+ */
+#define PS_REPLY_INT(m, val) PS_REPLY_INT_FL(m, val, 0)
+#define PS_REPLY_DBL(m, val) PS_REPLY_DBL_FL(m, val, 0)
+#define PS_REPLY_PTR(m, val) PS_REPLY_PTR_FL(m, val, 0)
+#define PS_REPLY_STR(m, val) PS_REPLY_STR_FL(m, val, 0)
+#define PS_REPLY_BOOL(m, val) PS_REPLY_BOOL_FL(m, val, 0)
+#define PS_REPLY_BUF(m, ptr, sz, dtor) PS_REPLY_BUF_FL(m, ptr, sz, dtor, 0)
+#define PS_REPLY_ERR(m, id, desc) PS_REPLY_ERR_FL(m, id, desc, 0)
+#define PS_REPLY_NIL(m) PS_REPLY_NIL_FL(m, 0)
+
 /**
  * @brief PS_CALL_INT PS_CALL_DBL PS_CALL_PTR PS_CALL_STR PS_CALL_BOOL PS_CALL_BUF are macros for simplifying the call
  * method of messages
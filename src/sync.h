@@ -8,6 +8,9 @@
 
 typedef void *mutex_t;
 typedef void *semaphore_t;
+typedef void *thread_t;
+typedef void *thread_key_t;
+typedef void (*thread_fn_t)(void *);
 
 int mutex_init(mutex_t *);
 int mutex_lock(mutex_t);
@@ -16,6 +19,17 @@ void mutex_destroy(mutex_t *);
 
 int semaphore_init(semaphore_t *, unsigned int value);
 int semaphore_wait(semaphore_t, int32_t timeout_ms);
+unsigned int semaphore_trywait_n(semaphore_t, unsigned int n);
 int semaphore_post(semaphore_t);
+int semaphore_post_n(semaphore_t, unsigned int n);
 int semaphore_get(semaphore_t);
-void semaphore_destroy(semaphore_t *);
\ No newline at end of file
+void semaphore_destroy(semaphore_t *);
+
+int thread_create(thread_t *, thread_fn_t fn, void *arg);
+void thread_join(thread_t *);
+void thread_yield(void);
+
+// Runs dtor with the value a thread set for the key when the thread exits, returns -1 if threads can't run destructors
+int thread_key_init(thread_key_t *, thread_fn_t dtor);
+int thread_key_set(thread_key_t, void *value);
+void thread_key_destroy(thread_key_t *);
\ No newline at end of file
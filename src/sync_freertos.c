@@ -6,6 +6,15 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/queue.h"
 #include "freertos/semphr.h"
+#include "freertos/task.h"
+
+#ifndef PS_THREAD_STACK_SIZE
+#define PS_THREAD_STACK_SIZE 4096
+#endif
+
+#ifndef PS_THREAD_PRIORITY
+#define PS_THREAD_PRIORITY (tskIDLE_PRIORITY + 1)
+#endif
 
 int mutex_init(mutex_t *_m) {
 	SemaphoreHandle_t *m = (SemaphoreHandle_t *) _m;
@@ -40,10 +49,27 @@ int semaphore_wait(semaphore_t s, int32_t timeout_ms) {
 	return xSemaphoreTake((SemaphoreHandle_t) s, pdMS_TO_TICKS(timeout_ms)) ? 0 : -1;
 }
 
+unsigned int semaphore_trywait_n(semaphore_t s, unsigned int n) {
+	unsigned int taken = 0;
+	while (taken < n && xSemaphoreTake((SemaphoreHandle_t) s, 0)) {
+		taken++;
+	}
+	return taken;
+}
+
 int semaphore_post(semaphore_t s) {
 	return xSemaphoreGive((SemaphoreHandle_t) s) ? 0 : -1;
 }
 
+int semaphore_post_n(semaphore_t s, unsigned int n) {
+	for (unsigned int i = 0; i < n; i++) {
+		if (!xSemaphoreGive((SemaphoreHandle_t) s)) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
 int semaphore_get(semaphore_t s) {
 	return uxSemaphoreGetCount((SemaphoreHandle_t) s);
 }
@@ -54,4 +80,62 @@ void semaphore_destroy(semaphore_t *_s) {
 	*s = NULL;
 }
 
+// Tasks can't be joined, the wrapper signals a semaphore when the function returns
+typedef struct thread_ctx_s {
+	thread_fn_t fn;
+	void *arg;
+	SemaphoreHandle_t done;
+} thread_ctx_t;
+
+static void thread_entry(void *v) {
+	thread_ctx_t *t = v;
+	t->fn(t->arg);
+	xSemaphoreGive(t->done);
+	vTaskDelete(NULL);
+}
+
+int thread_create(thread_t *_t, thread_fn_t fn, void *arg) {
+	thread_ctx_t *t = calloc(1, sizeof(thread_ctx_t));
+	t->fn = fn;
+	t->arg = arg;
+	t->done = xSemaphoreCreateBinary();
+	if (xTaskCreate(thread_entry, "ps", PS_THREAD_STACK_SIZE, t, PS_THREAD_PRIORITY, NULL) != pdPASS) {
+		vSemaphoreDelete(t->done);
+		free(t);
+		*_t = NULL;
+		return -1;
+	}
+	*_t = t;
+	return 0;
+}
+
+void thread_join(thread_t *_t) {
+	thread_ctx_t *t = (thread_ctx_t *) *_t;
+	xSemaphoreTake(t->done, portMAX_DELAY);
+	vSemaphoreDelete(t->done);
+	free(t);
+	*_t = NULL;
+}
+
+void thread_yield(void) {
+	vTaskDelay(1); // taskYIELD() would never let lower priority tasks run
+}
+
+// Delete callbacks of thread local storage run in the idle task, which must not block
+int thread_key_init(thread_key_t *_k, thread_fn_t dtor) {
+	(void) dtor; // unused
+	*_k = NULL;
+	return -1;
+}
+
+int thread_key_set(thread_key_t _k, void *value) {
+	(void) _k;    // unused
+	(void) value; // unused
+	return -1;
+}
+
+void thread_key_destroy(thread_key_t *_k) {
+	*_k = NULL;
+}
+
 #endif
\ No newline at end of file
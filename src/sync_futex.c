@@ -0,0 +1,162 @@
+#include "sync.h"
+
+#ifdef PS_SYNC_FUTEX
+
+#include <errno.h>
+#include <linux/futex.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Mutexes and semaphores built directly on futex words. Uncontended lock/unlock, post and wait
+ * are a single atomic operation, the kernel is only entered to sleep or to wake a sleeper.
+ * Timeouts are absolute CLOCK_MONOTONIC deadlines (FUTEX_WAIT_BITSET), so they don't move with
+ * wall-clock adjustments.
+ */
+
+enum { UNLOCKED, LOCKED, CONTENDED };
+
+typedef struct futex_sem_s {
+	uint32_t value;
+	uint32_t waiters;
+} futex_sem_t;
+
+static long futex_wait(uint32_t *addr, uint32_t val, const struct timespec *deadline) {
+	return syscall(SYS_futex, addr, FUTEX_WAIT_BITSET | FUTEX_PRIVATE_FLAG, val, deadline, NULL,
+	               FUTEX_BITSET_MATCH_ANY);
+}
+
+static long futex_wake(uint32_t *addr, uint32_t n) {
+	return syscall(SYS_futex, addr, FUTEX_WAKE | FUTEX_PRIVATE_FLAG, n, NULL, NULL, 0);
+}
+
+static void deadline_ms(int64_t ms, struct timespec *tout) {
+	clock_gettime(CLOCK_MONOTONIC, tout);
+	tout->tv_sec += (ms / 1000);
+	tout->tv_nsec += ((ms % 1000) * 1000000);
+	if (tout->tv_nsec >= 1000000000) {
+		tout->tv_sec++;
+		tout->tv_nsec -= 1000000000;
+	}
+}
+
+int mutex_init(mutex_t *_m) {
+	*_m = calloc(1, sizeof(uint32_t));
+	return *_m != NULL ? 0 : -1;
+}
+
+int mutex_lock(mutex_t _m) {
+	uint32_t *m = (uint32_t *) _m;
+	uint32_t c = UNLOCKED;
+	if (__atomic_compare_exchange_n(m, &c, LOCKED, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return 0;
+
+	// Mark it contended so the owner wakes us on unlock
+	if (c != CONTENDED)
+		c = __atomic_exchange_n(m, CONTENDED, __ATOMIC_ACQUIRE);
+	while (c != UNLOCKED) {
+		futex_wait(m, CONTENDED, NULL);
+		c = __atomic_exchange_n(m, CONTENDED, __ATOMIC_ACQUIRE);
+	}
+	return 0;
+}
+
+int mutex_unlock(mutex_t _m) {
+	uint32_t *m = (uint32_t *) _m;
+	if (__atomic_fetch_sub(m, 1, __ATOMIC_RELEASE) != LOCKED) {
+		__atomic_store_n(m, UNLOCKED, __ATOMIC_RELEASE);
+		futex_wake(m, 1);
+	}
+	return 0;
+}
+
+void mutex_destroy(mutex_t *_m) {
+	free(*_m);
+	*_m = NULL;
+}
+
+int semaphore_init(semaphore_t *_s, unsigned int value) {
+	futex_sem_t *s = calloc(1, sizeof(futex_sem_t));
+	*_s = s;
+	if (s == NULL)
+		return -1;
+	s->value = value;
+	return 0;
+}
+
+static bool semaphore_trywait(futex_sem_t *s) {
+	uint32_t v = __atomic_load_n(&s->value, __ATOMIC_RELAXED);
+	while (v > 0) {
+		if (__atomic_compare_exchange_n(&s->value, &v, v - 1, true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			return true;
+	}
+	return false;
+}
+
+int semaphore_wait(semaphore_t _s, int32_t timeout_ms) {
+	futex_sem_t *s = (futex_sem_t *) _s;
+	struct timespec tout = {0};
+
+	if (semaphore_trywait(s))
+		return 0;
+	if (timeout_ms == 0) {
+		errno = ETIMEDOUT;
+		return -1;
+	}
+	if (timeout_ms > 0)
+		deadline_ms(timeout_ms, &tout);
+
+	for (;;) {
+		// Pairs with the waiters check in semaphore_post_n: either the poster sees us or we see its value
+		__atomic_add_fetch(&s->waiters, 1, __ATOMIC_SEQ_CST);
+		long ret = futex_wait(&s->value, 0, timeout_ms < 0 ? NULL : &tout);
+		int err = errno;
+		__atomic_sub_fetch(&s->waiters, 1, __ATOMIC_SEQ_CST);
+
+		if (semaphore_trywait(s))
+			return 0;
+		if (ret < 0 && err == ETIMEDOUT) {
+			errno = ETIMEDOUT;
+			return -1;
+		}
+	}
+}
+
+unsigned int semaphore_trywait_n(semaphore_t _s, unsigned int n) {
+	futex_sem_t *s = (futex_sem_t *) _s;
+	uint32_t v = __atomic_load_n(&s->value, __ATOMIC_RELAXED);
+	uint32_t taken = 0;
+	do {
+		taken = v < n ? v : n;
+		if (taken == 0)
+			return 0;
+	} while (!__atomic_compare_exchange_n(&s->value, &v, v - taken, true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+	return taken;
+}
+
+int semaphore_post(semaphore_t s) {
+	return semaphore_post_n(s, 1);
+}
+
+int semaphore_post_n(semaphore_t _s, unsigned int n) {
+	futex_sem_t *s = (futex_sem_t *) _s;
+	__atomic_add_fetch(&s->value, n, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&s->waiters, __ATOMIC_SEQ_CST) > 0)
+		futex_wake(&s->value, n);
+	return 0;
+}
+
+int semaphore_get(semaphore_t _s) {
+	futex_sem_t *s = (futex_sem_t *) _s;
+	return __atomic_load_n(&s->value, __ATOMIC_RELAXED);
+}
+
+void semaphore_destroy(semaphore_t *_s) {
+	free(*_s);
+	*_s = NULL;
+}
+
+#endif
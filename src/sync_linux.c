@@ -59,17 +59,38 @@ int semaphore_wait(semaphore_t _s, int32_t timeout_ms) {
 
 	if (timeout_ms < 0) {
 		return sem_wait(s);
+	} else if (timeout_ms == 0) {
+		return sem_trywait(s); // A deadline in the past still sleeps for the timer slack
 	} else {
 		deadline_ms(timeout_ms, &tout);
 		return sem_timedwait(s, &tout);
 	}
 }
 
+unsigned int semaphore_trywait_n(semaphore_t _s, unsigned int n) {
+	sem_t *s = (sem_t *) _s;
+	unsigned int taken = 0;
+	while (taken < n && sem_trywait(s) == 0) {
+		taken++;
+	}
+	return taken;
+}
+
 int semaphore_post(semaphore_t _s) {
 	sem_t *s = (sem_t *) _s;
 	return sem_post(s);
 }
 
+int semaphore_post_n(semaphore_t _s, unsigned int n) {
+	sem_t *s = (sem_t *) _s;
+	for (unsigned int i = 0; i < n; i++) { // POSIX semaphores can't be posted n times at once
+		if (sem_post(s) != 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
 int semaphore_get(semaphore_t _s) {
 	sem_t *s = (sem_t *) _s;
 	int val = 0;
@@ -0,0 +1,72 @@
+#include "sync.h"
+
+#if defined(PS_SYNC_LINUX) || defined(PS_SYNC_FUTEX)
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+
+// Threads are pthreads on every Linux backend
+
+typedef struct thread_ctx_s {
+	pthread_t thread;
+	thread_fn_t fn;
+	void *arg;
+} thread_ctx_t;
+
+static void *thread_entry(void *v) {
+	thread_ctx_t *t = v;
+	t->fn(t->arg);
+	return NULL;
+}
+
+int thread_create(thread_t *_t, thread_fn_t fn, void *arg) {
+	thread_ctx_t *t = calloc(1, sizeof(thread_ctx_t));
+	t->fn = fn;
+	t->arg = arg;
+	if (pthread_create(&t->thread, NULL, thread_entry, t) != 0) {
+		free(t);
+		*_t = NULL;
+		return -1;
+	}
+	*_t = t;
+	return 0;
+}
+
+void thread_join(thread_t *_t) {
+	thread_ctx_t *t = (thread_ctx_t *) *_t;
+	pthread_join(t->thread, NULL);
+	free(t);
+	*_t = NULL;
+}
+
+void thread_yield(void) {
+	sched_yield();
+}
+
+int thread_key_init(thread_key_t *_k, thread_fn_t dtor) {
+	pthread_key_t **k = (pthread_key_t **) _k;
+	*k = calloc(1, sizeof(pthread_key_t));
+	if (pthread_key_create(*k, dtor) != 0) {
+		free(*k);
+		*k = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+int thread_key_set(thread_key_t _k, void *value) {
+	pthread_key_t *k = (pthread_key_t *) _k;
+	return pthread_setspecific(*k, value);
+}
+
+void thread_key_destroy(thread_key_t *_k) {
+	pthread_key_t **k = (pthread_key_t **) _k;
+	if (*k == NULL)
+		return;
+	pthread_key_delete(**k); // Destructors don't run any more
+	free(*k);
+	*k = NULL;
+}
+
+#endif
\ No newline at end of file
@@ -3,6 +3,8 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <math.h>
+#include <pthread.h>
+#include <unistd.h>
 #include "pubsub.h"
 
 uint64_t timespec_to_ns(struct timespec t) {
@@ -28,6 +30,8 @@ void test1(void) {
 
 	su = ps_new_subscriber(ITERATIONS, PS_STRLIST("topic.a"));
 	BENCH("publish without sub", ITERATIONS, { PS_PUB_INT("topic.b", 5); });
+	BENCH("publish without sub (ps_publish)", ITERATIONS,
+	      { ps_publish(ps_new_msg("topic.b", PS_INT_TYP, (int64_t) 5)); });
 	BENCH("publish without overflow", ITERATIONS, { PS_PUB_INT("topic.a", 5); });
 	BENCH("publish with overflow", ITERATIONS, { PS_PUB_INT("topic.a", 5); });
 	BENCH("ps_get and ps_unref_msg", ITERATIONS, { ps_unref_msg(ps_get(su, 1000)); });
@@ -50,6 +54,25 @@ void test2(void) {
 	ps_free_subscriber(su);
 }
 
+void test7(void) {
+	ps_subscriber_t *su = NULL;
+
+	su = ps_new_subscriber(ITERATIONS, PS_STRLIST("sensors"));
+	BENCH("publish 6 levels topic", ITERATIONS, { PS_PUB_INT("sensors.imu.accel.x.raw.value", 5); });
+	ps_flush(su);
+	BENCH("publish 6 levels topic without sub", ITERATIONS, { PS_PUB_INT("other.imu.accel.x.raw.value", 5); });
+
+	ps_topic_t *t = ps_topic_get("sensors.imu.accel.x.raw.value");
+	BENCH("publish 6 levels topic handle", ITERATIONS, { PS_PUB_TO_INT(t, 5); });
+	ps_flush(su);
+	ps_topic_unref(t);
+	t = ps_topic_get("other.imu.accel.x.raw.value");
+	BENCH("publish 6 levels topic handle without sub", ITERATIONS, { PS_PUB_TO_INT(t, 5); });
+	ps_topic_unref(t);
+
+	ps_free_subscriber(su);
+}
+
 void test3(size_t n) {
 	ps_subscriber_t **su = calloc(n, sizeof(ps_subscriber_t *));
 
@@ -70,10 +93,14 @@ void test4(size_t n) {
 	ps_subscriber_t **su = calloc(n, sizeof(ps_subscriber_t *));
 
 	for (size_t i = 0; i < n; i++) {
-		su[i] = ps_new_subscriber(100, PS_STRLIST("topic.a"));
+		su[i] = ps_new_subscriber(100, NULL);
 	}
 
 	char t[128] = {0};
+	snprintf(t, 128, "subscribe (%ld subs 1 topic)", n);
+	BENCH(t, n, { ps_subscribe(su[i], "topic.a"); });
+	snprintf(t, 128, "duplicated subscribe (%ld subs 1 topic)", n);
+	BENCH(t, n, { ps_subscribe(su[i], "topic.a"); });
 	snprintf(t, 128, "publish subbed topic (%ld subs 1 topic)", n);
 	BENCH(t, 100, { PS_PUB_INT("topic.a", 5); });
 
@@ -84,14 +111,615 @@ void test4(size_t n) {
 	free(su);
 }
 
+#define MT_MAX_THREADS 16
+#define MT_ITERATIONS 200000
+
+static void *mt_publisher(void *v) {
+	const char *topic = v;
+	for (int i = 0; i < MT_ITERATIONS; i++) {
+		PS_PUB_INT(topic, i);
+	}
+	return NULL;
+}
+
+void test5(size_t nthreads) {
+	pthread_t threads[MT_MAX_THREADS];
+	ps_subscriber_t *su[MT_MAX_THREADS];
+	char topics[MT_MAX_THREADS][32];
+	struct timespec t0, t1;
+
+	for (size_t i = 0; i < nthreads; i++) {
+		snprintf(topics[i], sizeof(topics[i]), "mt.t%ld", i);
+		su[i] = ps_new_subscriber(10, PS_STRLIST(topics[i]));
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (size_t i = 0; i < nthreads; i++) {
+		pthread_create(&threads[i], NULL, mt_publisher, topics[i]);
+	}
+	for (size_t i = 0; i < nthreads; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	uint64_t elapsed = timespec_to_ns(t1) - timespec_to_ns(t0);
+	printf("%s/publish %ld threads\t%.2f Mmsg/s\n", __FUNCTION__, nthreads,
+	       (double) nthreads * MT_ITERATIONS * 1000 / elapsed);
+
+	for (size_t i = 0; i < nthreads; i++) {
+		ps_free_subscriber(su[i]);
+	}
+}
+
+static void *mt_sticky_publisher(void *v) {
+	const char *topic = v;
+	for (int i = 0; i < MT_ITERATIONS; i++) {
+		PS_PUB_INT_FL(topic, i, PS_FL_STICKY);
+	}
+	return NULL;
+}
+
+void test6(size_t shards, size_t nthreads) {
+	pthread_t threads[MT_MAX_THREADS];
+	ps_subscriber_t *su[MT_MAX_THREADS];
+	char topics[MT_MAX_THREADS][32];
+	struct timespec t0, t1;
+
+	ps_deinit();
+	ps_init_opts(&(ps_opts_t){.shards = shards});
+	for (size_t i = 0; i < nthreads; i++) {
+		snprintf(topics[i], sizeof(topics[i]), "st%ld.status", i);
+		su[i] = ps_new_subscriber(10, PS_STRLIST(topics[i]));
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (size_t i = 0; i < nthreads; i++) {
+		pthread_create(&threads[i], NULL, mt_sticky_publisher, topics[i]);
+	}
+	for (size_t i = 0; i < nthreads; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	uint64_t elapsed = timespec_to_ns(t1) - timespec_to_ns(t0);
+	printf("%s/sticky publish %ld shards %ld threads\t%.2f Mmsg/s\n", __FUNCTION__, shards, nthreads,
+	       (double) nthreads * MT_ITERATIONS * 1000 / elapsed);
+
+	for (size_t i = 0; i < nthreads; i++) {
+		ps_free_subscriber(su[i]);
+	}
+	ps_clean_sticky("");
+}
+
+void test8(size_t levels) {
+	ps_subscriber_t *su = NULL;
+	char topic[256] = {0};
+	size_t len = 0;
+
+	for (size_t i = 0; i < levels; i++) {
+		len += snprintf(topic + len, sizeof(topic) - len, "%slevel%ld", i > 0 ? "." : "", i);
+	}
+	su = ps_new_subscriber(ITERATIONS, PS_STRLIST(topic));
+
+	char t[128] = {0};
+	snprintf(t, 128, "publish %ld levels topic", levels);
+	BENCH(t, ITERATIONS, { PS_PUB_INT(topic, 5); });
+
+	ps_free_subscriber(su);
+}
+
+void test9(size_t n) {
+	ps_subscriber_t *su = NULL;
+	char topic[64] = {0};
+
+	su = ps_new_subscriber(ITERATIONS, NULL);
+	for (size_t i = 0; i < n; i++) {
+		snprintf(topic, sizeof(topic), "fleet%ld.*.status", i);
+		ps_subscribe(su, topic);
+	}
+
+	char t[128] = {0};
+	snprintf(t, 128, "publish matching topic (%ld patterns)", n);
+	BENCH(t, ITERATIONS, { PS_PUB_INT("fleet0.truck.status", 5); });
+	ps_flush(su);
+	snprintf(t, 128, "publish nonmatching topic (%ld patterns)", n);
+	BENCH(t, ITERATIONS, { PS_PUB_INT("fleet0.truck.position", 5); });
+
+	ps_free_subscriber(su);
+}
+
+#define BATCH_MAX 512
+
+void test10(size_t batch, bool use_batch) {
+	ps_subscriber_t *su = NULL;
+	ps_msg_t *msgs[BATCH_MAX];
+	struct timespec t0, t1;
+
+	su = ps_new_subscriber(ITERATIONS, PS_STRLIST("batch.a"));
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (size_t i = 0; i < ITERATIONS / batch; i++) {
+		for (size_t j = 0; j < batch; j++) {
+			msgs[j] = ps_new_msg("batch.a", PS_INT_TYP, (int64_t) j);
+		}
+		if (use_batch) {
+			ps_publish_batch(msgs, batch);
+		} else {
+			for (size_t j = 0; j < batch; j++) {
+				ps_publish(msgs[j]);
+			}
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	uint64_t elapsed = timespec_to_ns(t1) - timespec_to_ns(t0);
+	printf("%s/%s of %ld\t%ld ns/msg\n", __FUNCTION__, use_batch ? "publish batch" : "publish one by one", batch,
+	       elapsed / (ITERATIONS / batch * batch));
+	ps_free_subscriber(su);
+}
+
+void test11(size_t batch) {
+	ps_subscriber_t *su = NULL;
+	ps_msg_t *msgs[BATCH_MAX];
+	struct timespec t0, t1;
+	size_t n = 0;
+
+	su = ps_new_subscriber(ITERATIONS, PS_STRLIST("batch.a"));
+	for (int i = 0; i < ITERATIONS; i++) {
+		PS_PUB_INT("batch.a", i);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	while ((n = ps_get_many(su, msgs, batch, 0)) > 0) {
+		for (size_t i = 0; i < n; i++) {
+			ps_unref_msg(msgs[i]);
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	uint64_t elapsed = timespec_to_ns(t1) - timespec_to_ns(t0);
+	printf("%s/ps_get_many of %ld and ps_unref_msg\t%ld ns/msg\n", __FUNCTION__, batch, elapsed / ITERATIONS);
+	ps_free_subscriber(su);
+}
+
+void test12(void) {
+	BENCH("ps_new_subscriber and ps_free_subscriber with 1M queue", 100, {
+		ps_free_subscriber(ps_new_subscriber(ITERATIONS, PS_STRLIST("topic.a")));
+	});
+}
+
+#define PINGPONG_ITERATIONS 100000
+
+static void *pong(void *v) {
+	ps_subscriber_t *su = v;
+	for (int i = 0; i < PINGPONG_ITERATIONS; i++) {
+		ps_unref_msg(ps_get(su, -1));
+		PS_PUB_INT("pingpong.pong", i);
+	}
+	return NULL;
+}
+
+// Round trips between two threads, every ps_get blocks so it measures the semaphore wake path
+void test13(void) {
+	pthread_t thread;
+	struct timespec t0, t1;
+
+	ps_subscriber_t *ping = ps_new_subscriber(10, PS_STRLIST("pingpong.pong"));
+	ps_subscriber_t *su = ps_new_subscriber(10, PS_STRLIST("pingpong.ping"));
+	pthread_create(&thread, NULL, pong, su);
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (int i = 0; i < PINGPONG_ITERATIONS; i++) {
+		PS_PUB_INT("pingpong.ping", i);
+		ps_unref_msg(ps_get(ping, -1));
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	pthread_join(thread, NULL);
+
+	uint64_t elapsed = timespec_to_ns(t1) - timespec_to_ns(t0);
+	printf("%s/ping pong between 2 threads\t%ld ns/round trip\n", __FUNCTION__, elapsed / PINGPONG_ITERATIONS);
+	ps_free_subscriber(ping);
+	ps_free_subscriber(su);
+}
+
+#define SLOW_CB_ITERATIONS 2000
+
+static bool slow_cb_stop;
+
+static void slow_cb(ps_subscriber_t *su) {
+	(void) su;
+	usleep(1000);
+}
+
+static void *slow_publisher(void *v) {
+	(void) v;
+	while (!__atomic_load_n(&slow_cb_stop, __ATOMIC_RELAXED)) {
+		PS_PUB_INT_FL("slow.a", 1, PS_FL_STICKY);
+	}
+	return NULL;
+}
+
+// Sticky publishes on a topic of the same shard while another thread publishes to a subscriber with a slow callback
+void test14(void) {
+	pthread_t thread;
+	ps_subscriber_t *slow = ps_new_subscriber(10, PS_STRLIST("slow.a"));
+	ps_subscriber_t *su = ps_new_subscriber(10, PS_STRLIST("slow.b"));
+	ps_set_new_msg_cb(slow, slow_cb);
+
+	slow_cb_stop = false;
+	pthread_create(&thread, NULL, slow_publisher, NULL);
+	usleep(10000);
+	BENCH("sticky publish next to a 1ms callback", SLOW_CB_ITERATIONS, { PS_PUB_INT_FL("slow.b", 5, PS_FL_STICKY); });
+	__atomic_store_n(&slow_cb_stop, true, __ATOMIC_RELAXED);
+	pthread_join(thread, NULL);
+
+	ps_free_subscriber(slow);
+	ps_free_subscriber(su);
+	ps_clean_sticky("slow");
+}
+
+#define FANIN_SUBS 256
+#define FANIN_ITERATIONS 200000
+
+static uint32_t fanin_handled;
+
+static void fanin_handler(ps_subscriber_t *su, ps_msg_t *msg) {
+	(void) su;
+	(void) msg;
+	__atomic_add_fetch(&fanin_handled, 1, __ATOMIC_RELAXED);
+}
+
+static void *fanin_thread(void *v) {
+	ps_subscriber_t *su = v;
+	for (;;) {
+		ps_msg_t *msg = ps_get(su, -1);
+		bool stop = PS_IS_NIL(msg);
+		ps_unref_msg(msg);
+		if (stop)
+			return NULL;
+		__atomic_add_fetch(&fanin_handled, 1, __ATOMIC_RELAXED);
+	}
+}
+
+// Messages spread over many subscribers, handled by a thread per subscriber or by a dispatcher pool
+void test15(size_t workers) {
+	pthread_t threads[FANIN_SUBS];
+	ps_subscriber_t *su[FANIN_SUBS];
+	char topic[32];
+	struct timespec t0, t1;
+	ps_dispatcher_t *d = workers > 0 ? ps_new_dispatcher(workers) : NULL;
+
+	fanin_handled = 0;
+	for (size_t i = 0; i < FANIN_SUBS; i++) {
+		snprintf(topic, sizeof(topic), "fanin.%ld", i);
+		su[i] = ps_new_subscriber(FANIN_ITERATIONS, PS_STRLIST(topic));
+		if (d != NULL) {
+			ps_dispatcher_add(d, su[i], fanin_handler);
+		} else {
+			pthread_create(&threads[i], NULL, fanin_thread, su[i]);
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (int i = 0; i < FANIN_ITERATIONS; i++) {
+		snprintf(topic, sizeof(topic), "fanin.%d", i % FANIN_SUBS);
+		PS_PUB_INT(topic, i);
+	}
+	while (__atomic_load_n(&fanin_handled, __ATOMIC_RELAXED) < FANIN_ITERATIONS) {
+		sched_yield();
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	uint64_t elapsed = timespec_to_ns(t1) - timespec_to_ns(t0);
+	if (d != NULL) {
+		printf("%s/%d subscribers on a %ld worker dispatcher\t%ld ns/msg\n", __FUNCTION__, FANIN_SUBS, workers,
+		       elapsed / FANIN_ITERATIONS);
+	} else {
+		printf("%s/%d subscribers with a thread each\t%ld ns/msg\n", __FUNCTION__, FANIN_SUBS,
+		       elapsed / FANIN_ITERATIONS);
+	}
+
+	for (size_t i = 0; i < FANIN_SUBS; i++) {
+		if (d == NULL) {
+			snprintf(topic, sizeof(topic), "fanin.%ld", i);
+			PS_PUB_NIL(topic);
+			pthread_join(threads[i], NULL);
+		}
+		ps_free_subscriber(su[i]);
+	}
+	ps_free_dispatcher(d);
+}
+
+static void *pool_consumer(void *v) {
+	ps_subscriber_t *su = v;
+	for (int i = 0; i < MT_ITERATIONS; i++) {
+		ps_unref_msg(ps_get(su, -1));
+	}
+	return NULL;
+}
+
+// Message allocation with and without the message pool, in the same thread and freed by a consumer thread
+void test16(bool pool) {
+	pthread_t thread;
+	struct timespec t0, t1;
+	const char *name = pool ? "pool" : "malloc";
+	char t[128];
+
+	ps_deinit();
+	ps_init_opts(&(ps_opts_t){.msg_pool = pool});
+
+	snprintf(t, sizeof(t), "ps_new_msg and ps_unref_msg (%s)", name);
+	BENCH(t, ITERATIONS, { ps_unref_msg(ps_new_msg("pool.a", PS_INT_TYP, (int64_t) i)); });
+
+	ps_subscriber_t *su = ps_new_subscriber(MT_ITERATIONS, PS_STRLIST("pool.a"));
+	pthread_create(&thread, NULL, pool_consumer, su);
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (int i = 0; i < MT_ITERATIONS; i++) {
+		PS_PUB_INT("pool.a", i);
+	}
+	pthread_join(thread, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	uint64_t elapsed = timespec_to_ns(t1) - timespec_to_ns(t0);
+	printf("%s/publish and unref in a consumer thread (%s)\t%ld ns/msg\n", __FUNCTION__, name,
+	       elapsed / MT_ITERATIONS);
+	ps_free_subscriber(su);
+
+	ps_deinit();
+	ps_init();
+}
+
+#define LONG_TOPIC "sensors.building_a.floor_3.room_301.thermostat.temperature"
+
+void test17(void) {
+	BENCH("ps_new_msg and ps_unref_msg (short topic)", ITERATIONS,
+	      { ps_unref_msg(ps_new_msg("sensors.temp", PS_INT_TYP, (int64_t) i)); });
+	BENCH("ps_new_msg and ps_unref_msg (long topic)", ITERATIONS,
+	      { ps_unref_msg(ps_new_msg(LONG_TOPIC, PS_INT_TYP, (int64_t) i)); });
+	ps_subscriber_t *su = ps_new_subscriber(1, PS_STRLIST(LONG_TOPIC));
+	BENCH("PS_PUB_INT to a full queue (long subscribed topic)", ITERATIONS, { PS_PUB_INT(LONG_TOPIC, i); });
+	ps_free_subscriber(su);
+
+	ps_msg_t *msg = ps_new_msg(LONG_TOPIC, PS_NIL_TYP);
+	volatile bool found;
+	BENCH("ps_has_topic (long topic)", ITERATIONS, { found = ps_has_topic(msg, LONG_TOPIC ".x"); });
+	(void) found;
+	ps_unref_msg(msg);
+}
+
+#define FRAME_SIZE (64 * 1024)
+#define FRAME_ITERATIONS 20000
+
+void test18(void) {
+	BENCH("64KB buffer re-published to 3 topics with ps_dup_msg", FRAME_ITERATIONS, {
+		ps_msg_t *msg = ps_new_msg("cam.frame", PS_BUF_TYP, calloc(1, FRAME_SIZE), (size_t) FRAME_SIZE, free);
+		for (int j = 0; j < 3; j++) {
+			ps_msg_t *dup = ps_dup_msg(msg);
+			ps_msg_set_topic(dup, "cam.frame.out");
+			ps_unref_msg(dup);
+		}
+		ps_unref_msg(msg);
+	});
+}
+
+#define CHURN_SUBS 100000
+#define CHURN_TOPICS 100
+
+void test19(void) {
+	ps_subscriber_t **su = calloc(CHURN_SUBS, sizeof(ps_subscriber_t *));
+	for (size_t i = 0; i < CHURN_SUBS; i++) {
+		su[i] = ps_new_subscriber(1, NULL);
+	}
+	BENCH("subscribe (100000 subs 1 topic)", CHURN_SUBS, { ps_subscribe(su[i], "churn.a"); });
+	BENCH("unsubscribe and subscribe again (100000 subs 1 topic)", CHURN_SUBS, {
+		ps_unsubscribe(su[i], "churn.a");
+		ps_subscribe(su[i], "churn.a");
+	});
+	BENCH("unsubscribe (100000 subs 1 topic)", CHURN_SUBS, { ps_unsubscribe(su[(i * 7919) % CHURN_SUBS], "churn.a"); });
+	for (size_t i = 0; i < CHURN_SUBS; i++) {
+		ps_subscribe(su[i], "churn.a");
+	}
+	BENCH("ps_free_subscriber (100000 subs 1 topic)", CHURN_SUBS, { ps_free_subscriber(su[i]); });
+
+	// One subscriber with many topics
+	char t[128];
+	ps_subscriber_t *s1 = ps_new_subscriber(1, NULL);
+	for (size_t i = 0; i < CHURN_TOPICS; i++) {
+		snprintf(t, sizeof(t), "churn.%ld", i);
+		ps_subscribe(s1, t);
+	}
+	BENCH("unsubscribe and subscribe again (1 sub 100 topics)", ITERATIONS, {
+		snprintf(t, sizeof(t), "churn.%d", i % CHURN_TOPICS);
+		ps_unsubscribe(s1, t);
+		ps_subscribe(s1, t);
+	});
+	ps_free_subscriber(s1);
+	free(su);
+}
+
+#define STICKY_TOPICS 10
+
+// Child sticky subscribe with a few sticky topics among many topics kept alive by subscriptions
+void test20(size_t n) {
+	char topic[64] = {0};
+	ps_subscriber_t *holder = ps_new_subscriber(1, NULL);
+	ps_subscriber_t *su = ps_new_subscriber(STICKY_TOPICS, NULL);
+	for (size_t i = 0; i < n; i++) {
+		snprintf(topic, sizeof(topic), "fleet.t%ld.evt", i);
+		ps_subscribe(holder, topic);
+	}
+	for (size_t i = 0; i < STICKY_TOPICS; i++) {
+		snprintf(topic, sizeof(topic), "fleet.t%ld.status", i * (n / STICKY_TOPICS));
+		PS_PUB_INT_FL(topic, i, PS_FL_STICKY);
+	}
+
+	char t[128] = {0};
+	snprintf(t, 128, "child sticky subscribe (%ld topics)", n);
+	BENCH(t, 10000, {
+		ps_subscribe(su, "fleet" PS_SUB_CHILDSTICKY);
+		ps_unsubscribe(su, "fleet");
+		ps_flush(su);
+	});
+	snprintf(t, 128, "clean sticky (%ld topics)", n);
+	BENCH(t, 10000, {
+		PS_PUB_INT_FL("fleet.t0.status", i, PS_FL_STICKY);
+		ps_clean_sticky("fleet");
+	});
+
+	ps_free_subscriber(su);
+	ps_free_subscriber(holder);
+}
+
+#define SNAPSHOT_TOPICS 10000
+
+// Restoring the sticky state from a snapshot against publishing it again
+void test21(void) {
+	char topic[64] = {0};
+	BENCH("publish 10000 sticky messages", 10, {
+		ps_clean_sticky("snap");
+		for (size_t j = 0; j < SNAPSHOT_TOPICS; j++) {
+			snprintf(topic, sizeof(topic), "snap.dev%ld.cfg", j);
+			PS_PUB_STR_FL(topic, "{\"mode\": \"auto\", \"rate\": 100}", PS_FL_STICKY);
+		}
+	});
+	BENCH("ps_sticky_save 10000 sticky messages", 10, { ps_sticky_save("benchmark-sticky.out"); });
+	BENCH("ps_sticky_load 10000 sticky messages", 10, {
+		ps_clean_sticky("snap");
+		ps_sticky_load("benchmark-sticky.out");
+	});
+	ps_clean_sticky("snap");
+	unlink("benchmark-sticky.out");
+}
+
+#define RPC_CALLS 100000
+
+static void *rpc_server(void *v) {
+	ps_subscriber_t *su = v;
+	for (;;) {
+		ps_msg_t *msg = ps_get(su, -1);
+		if (msg->rtopic == NULL) {
+			ps_unref_msg(msg);
+			break;
+		}
+		PS_REPLY_INT(msg, msg->int_val + 1);
+		ps_unref_msg(msg);
+	}
+	return NULL;
+}
+
+// RPC round trip to a server thread
+void test22(void) {
+	pthread_t thread;
+	ps_subscriber_t *su = ps_new_subscriber(16, PS_STRLIST("rpc.inc"));
+	pthread_create(&thread, NULL, rpc_server, su);
+	BENCH("ps_call round trip", RPC_CALLS, { ps_unref_msg(PS_CALL_INT("rpc.inc", i, 1000)); });
+	BENCH("ps_call without server", RPC_CALLS, { ps_unref_msg(PS_CALL_INT("rpc.none", i, 1000)); });
+	PS_PUB_NIL("rpc.inc");
+	pthread_join(thread, NULL);
+	ps_free_subscriber(su);
+}
+
+#define FANOUT_MAX 1000
+
+// Calls to a server thread kept in flight with ps_call_start, n at a time
+void test23(size_t n) {
+	pthread_t thread;
+	static ps_call_t *calls[FANOUT_MAX];
+	ps_subscriber_t *su = ps_new_subscriber(FANOUT_MAX, PS_STRLIST("rpc.inc"));
+	pthread_create(&thread, NULL, rpc_server, su);
+	char t[128] = {0};
+	snprintf(t, 128, "ps_call_start and ps_call_wait (%ld in flight)", n);
+	BENCH(t, RPC_CALLS, {
+		calls[i % n] = ps_call_start(ps_new_msg("rpc.inc", PS_INT_TYP, (int64_t) i), 1000);
+		if (i % n == n - 1) {
+			for (size_t j = 0; j < n; j++) {
+				ps_unref_msg(ps_call_wait(calls[j]));
+			}
+		}
+	});
+	PS_PUB_NIL("rpc.inc");
+	pthread_join(thread, NULL);
+	ps_free_subscriber(su);
+}
+
+#define RESPONDERS_MAX 16
+#define GATHER_CALLS 10000
+
+// Scatter-gather to n server threads against calling each of them in turn
+void test24(size_t n) {
+	pthread_t threads[RESPONDERS_MAX];
+	ps_subscriber_t *su[RESPONDERS_MAX];
+	ps_msg_t *replies[RESPONDERS_MAX];
+	char topic[32];
+	for (size_t i = 0; i < n; i++) {
+		snprintf(topic, sizeof(topic), "svc.%ld.inc", i);
+		su[i] = ps_new_subscriber(16, PS_STRLIST(topic, "svc.all"));
+		pthread_create(&threads[i], NULL, rpc_server, su[i]);
+	}
+	char t[128] = {0};
+	snprintf(t, 128, "ps_call_all (%ld responders)", n);
+	BENCH(t, GATHER_CALLS, {
+		size_t got = ps_call_all(ps_new_msg("svc.all", PS_INT_TYP, (int64_t) i), 1000, replies, RESPONDERS_MAX);
+		for (size_t j = 0; j < got; j++) {
+			ps_unref_msg(replies[j]);
+		}
+	});
+	snprintf(t, 128, "ps_call to each (%ld responders)", n);
+	BENCH(t, GATHER_CALLS, {
+		for (size_t j = 0; j < n; j++) {
+			snprintf(topic, sizeof(topic), "svc.%ld.inc", j);
+			ps_unref_msg(PS_CALL_INT(topic, i, 1000));
+		}
+	});
+	for (size_t i = 0; i < n; i++) {
+		snprintf(topic, sizeof(topic), "svc.%ld.inc", i);
+		PS_PUB_NIL(topic);
+		pthread_join(threads[i], NULL);
+		ps_free_subscriber(su[i]);
+	}
+}
+
 int main(int argc, char **argv) {
 	ps_init();
 	test1();
+	test12();
+	test16(false);
+	test16(true);
+	test17();
+	test18();
+	test19();
+	for (size_t i = 2; i <= 5; i++)
+		test20(pow(10, i));
+	test21();
+	test22();
+	for (size_t i = 0; i < 4; i++)
+		test23(pow(10, i));
+	for (size_t i = 1; i <= RESPONDERS_MAX; i *= 4)
+		test24(i);
 	test2();
+	test7();
+	for (size_t i = 1; i <= 16; i++)
+		test8(i);
+	for (size_t i = 0; i < 5; i++)
+		test9(pow(10, i));
+	for (size_t i = 1; i <= BATCH_MAX; i *= 8) {
+		test10(i, false);
+		test10(i, true);
+	}
+	for (size_t i = 1; i <= 64; i *= 8)
+		test11(i);
 	for (size_t i = 0; i < 5; i++)
 		test3(pow(10, i));
 	for (size_t i = 0; i < 5; i++)
 		test4(pow(10, i));
+	for (size_t i = 1; i <= MT_MAX_THREADS; i *= 2)
+		test5(i);
+	test13();
+	test14();
+	test15(0);
+	for (size_t i = 1; i <= 4; i *= 2)
+		test15(i);
+	for (size_t i = 8; i <= MT_MAX_THREADS; i *= 2) {
+		test6(1, i);
+		test6(PS_TOPIC_SHARDS, i);
+	}
 	ps_deinit();
 	return 0;
 }
\ No newline at end of file
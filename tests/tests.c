@@ -3,6 +3,9 @@
 #include <string.h>
 #include <assert.h>
 #include <pthread.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "pubsub.h"
 
@@ -42,6 +45,114 @@ static void non_empty_cb(ps_subscriber_t *su) {
 	non_empty_cb_subscriber = su;
 }
 
+#define CONCURRENT_THREADS 4
+#define CONCURRENT_MSGS 5000
+
+static void *publisher_thread(void *v) {
+	char topic[32];
+	snprintf(topic, sizeof(topic), "conc.t%d", (int) (intptr_t) v);
+	for (int i = 0; i < CONCURRENT_MSGS; i++) {
+		PS_PUB_INT(topic, i);
+	}
+	return NULL;
+}
+
+#define ASYNC_CALLS 1000
+
+static void *rpc_thread(void *v) {
+	(void) v; // unused
+	ps_subscriber_t *s =
+	ps_new_subscriber(ASYNC_CALLS, PS_STRLIST("rpc.echo", "rpc.twice", "rpc.slow", "rpc.exact", "rpc.stop"));
+	PS_PUB_BOOL_FL("rpc.ready", true, PS_FL_STICKY);
+	for (;;) {
+		ps_msg_t *msg = ps_get(s, 5000);
+		assert(msg != NULL);
+		if (ps_has_topic(msg, "rpc.stop")) {
+			ps_unref_msg(msg);
+			break;
+		}
+		if (ps_has_topic(msg, "rpc.slow")) {
+			usleep(30000);
+		}
+		if (ps_has_topic(msg, "rpc.exact")) {
+			PS_REPLY_INT_FL(msg, msg->int_val + 1, PS_FL_NONRECURSIVE);
+			ps_unref_msg(msg);
+			continue;
+		}
+		PS_REPLY_INT(msg, msg->int_val + 1);
+		if (ps_has_topic(msg, "rpc.twice")) {
+			ps_reply(msg, ps_new_msg("any", PS_INT_TYP, msg->int_val + 2));
+		}
+		ps_unref_msg(msg);
+	}
+	ps_free_subscriber(s);
+	return NULL;
+}
+
+// Answers the calls to "nest" with a call of its own, made from the callback of the outer call
+static void nested_call_cb(ps_subscriber_t *su) {
+	ps_msg_t *msg = ps_get(su, 0);
+	ps_msg_t *reply = PS_CALL_INT("rpc.echo", msg->int_val, 1000);
+	assert(reply != NULL);
+	PS_REPLY_INT(msg, reply->int_val);
+	ps_unref_msg(reply);
+	ps_unref_msg(msg);
+}
+
+// Makes a call from its own thread and returns the reply topic in v
+static void *caller_thread(void *v) {
+	ps_msg_t *msg = PS_CALL_INT("rpc.echo", 1, 1000);
+	assert(msg != NULL && msg->int_val == 2);
+	strcpy(v, msg->topic);
+	ps_unref_msg(msg);
+	return NULL;
+}
+
+static int async_replies;
+static int async_timeouts;
+static int async_order[3];
+
+// Callbacks run in the call thread, one at a time
+static void async_cb(ps_msg_t *reply, void *ctx) {
+	int *expected = ctx;
+	if (reply != NULL) {
+		assert(reply->int_val == *expected + 1);
+	} else {
+		async_order[async_timeouts++ % 3] = *expected;
+	}
+	__sync_fetch_and_add(&async_replies, 1);
+}
+
+static int call_thread_blocked;
+
+// Keeps the call thread busy until the test releases it
+static void blocking_cb(ps_msg_t *reply, void *ctx) {
+	(void) reply; // unused
+	(void) ctx;   // unused
+	__atomic_store_n(&call_thread_blocked, 1, __ATOMIC_RELEASE);
+	while (__atomic_load_n(&call_thread_blocked, __ATOMIC_ACQUIRE) == 1) {
+		usleep(1000);
+	}
+}
+
+static void wait_async_replies(int n) {
+	for (int i = 0; i < 5000 && __sync_fetch_and_add(&async_replies, 0) < n; i++) {
+		usleep(1000);
+	}
+	assert(__sync_fetch_and_add(&async_replies, 0) == n);
+}
+
+static void *responder_thread(void *v) {
+	ps_subscriber_t *s = v;
+	ps_msg_t *msg;
+	while ((msg = ps_get(s, 5000)) != NULL && msg->rtopic != NULL) {
+		PS_REPLY_INT(msg, (intptr_t) ps_subscriber_user_data(s));
+		ps_unref_msg(msg);
+	}
+	ps_unref_msg(msg);
+	return NULL;
+}
+
 /* End helper functions*/
 
 /* Test Functions */
@@ -128,6 +239,40 @@ void test_subs_count(void) {
 	check_leak();
 }
 
+#define CHURN_SUBS 100
+
+void test_subscriber_churn(void) {
+	printf("Test subscriber churn\n");
+	ps_subscriber_t *su[CHURN_SUBS];
+	for (int i = 0; i < CHURN_SUBS; i++) {
+		su[i] = ps_new_subscriber(CHURN_SUBS, PS_STRLIST("churn"));
+		assert(ps_subscribe(su[i], "churn") == -1);
+	}
+	assert(ps_subs_count("churn") == CHURN_SUBS);
+
+	// Drop most of them, then bring some back
+	for (int i = 0; i < CHURN_SUBS; i++) {
+		if (i % 4 != 0) {
+			assert(ps_unsubscribe(su[i], "churn") == 0);
+			assert(ps_unsubscribe(su[i], "churn") == -1);
+		}
+	}
+	assert(ps_subs_count("churn") == CHURN_SUBS / 4);
+	for (int i = 0; i < CHURN_SUBS; i += 2) {
+		ps_subscribe(su[i], "churn" PS_SUB_PRIO(3));
+	}
+	assert(ps_subs_count("churn") == CHURN_SUBS / 2);
+
+	// Each subscriber gets a single copy
+	assert(PS_PUB_INT("churn", 1) == CHURN_SUBS / 2);
+	for (int i = 0; i < CHURN_SUBS; i++) {
+		assert(ps_waiting(su[i]) == (i % 2 == 0 ? 1 : 0));
+		ps_free_subscriber(su[i]);
+	}
+	assert(ps_subs_count("churn") == 0);
+	check_leak();
+}
+
 void test_subscribe_many(void) {
 	printf("Test subscribe/unsubscribe many\n");
 	ps_subscriber_t *s1 = ps_new_subscriber(10, NULL);
@@ -233,6 +378,476 @@ void test_child_sticky_flag(void) {
 	check_leak();
 }
 
+void test_child_sticky_index(void) {
+	printf("Test child sticky index\n");
+	ps_subscriber_t *s0 = ps_new_subscriber(10, PS_STRLIST("idx.a.x", "idx.b.y.z"));
+	PS_PUB_INT_FL("idx.a.x.1", 1, PS_FL_STICKY);
+	PS_PUB_INT_FL("idx.a.x.1", 2, PS_FL_STICKY); // Replaces the previous one
+	PS_PUB_INT_FL("idx.a.x", 3, PS_FL_STICKY);
+	PS_PUB_INT_FL("idx.b.y.z.2", 4, PS_FL_STICKY);
+	ps_flush(s0);
+
+	ps_subscriber_t *s1 = ps_new_subscriber(10, PS_STRLIST("idx" PS_SUB_CHILDSTICKY));
+	assert(ps_waiting(s1) == 3);
+	ps_flush(s1);
+
+	PS_PUB_NIL("idx.a.x"); // A non sticky publish removes the sticky message
+	ps_flush(s0);
+	ps_flush(s1);
+	ps_subscribe(s1, "idx.a" PS_SUB_CHILDSTICKY);
+	assert(ps_waiting(s1) == 1);
+	ps_flush(s1);
+
+	ps_topic_t *t = ps_topic_get("idx.b.y.z.2");
+	PS_PUB_TO_NIL(t);
+	ps_flush(s0);
+	ps_flush(s1);
+	PS_PUB_TO_INT_FL(t, 5, PS_FL_STICKY);
+	ps_flush(s0);
+	ps_flush(s1);
+	ps_subscribe(s1, "idx.b" PS_SUB_CHILDSTICKY);
+	assert(ps_waiting(s1) == 1);
+	ps_flush(s1);
+
+	ps_clean_sticky("idx.a");
+	ps_subscribe(s1, "idx.*" PS_SUB_CHILDSTICKY);
+	assert(ps_waiting(s1) == 1);
+	ps_flush(s1);
+	ps_clean_sticky("idx");
+	ps_subscribe(s1, "idx.#");
+	assert(ps_waiting(s1) == 0);
+	ps_topic_unref(t);
+
+	ps_free_subscriber(s0);
+	ps_free_subscriber(s1);
+	check_leak();
+}
+
+#define SNAPSHOT_FILE "sticky.out"
+
+void test_sticky_snapshot(void) {
+	printf("Test sticky snapshot\n");
+	static const char buf[] = {1, 2, 0, 3};
+	int ptr;
+	ps_msg_t *msg = ps_new_msg("snap.int", PS_FL_STICKY | PS_INT_TYP, (int64_t) -5);
+	msg->priority = 3;
+	ps_publish(msg);
+	PS_PUB_DBL_FL("snap.dbl", 1.5, PS_FL_STICKY);
+	PS_PUB_BOOL_FL("snap.bool", true, PS_FL_STICKY);
+	PS_PUB_STR_FL("snap.str", "hello", PS_FL_STICKY);
+	PS_PUB_BUF_FL("snap.buf", buf, sizeof(buf), NULL, PS_FL_STICKY | PS_JSON_ENC);
+	PS_PUB_ERR_FL("snap.err", 42, "failed", PS_FL_STICKY);
+	PS_PUB_NIL_FL("snap.nil", PS_FL_STICKY);
+	PS_PUB_PTR_FL("snap.ptr", &ptr, PS_FL_STICKY); // Skipped
+	PS_PUB_INT_FL("snap.long.topic.name.that.doesnt.fit.inline.in.the.message", 7, PS_FL_STICKY);
+	assert(ps_sticky_save(SNAPSHOT_FILE) == 8);
+	ps_clean_sticky("");
+	assert(ps_stats_live_msg() == 0);
+
+	assert(ps_sticky_load(SNAPSHOT_FILE) == 8);
+	assert(ps_stats_live_msg() == 8);
+	ps_subscriber_t *s1 = ps_new_subscriber(10, PS_STRLIST("snap" PS_SUB_CHILDSTICKY));
+	assert(ps_waiting(s1) == 8);
+	int found = 0;
+	while ((msg = ps_get(s1, 0)) != NULL) {
+		assert(msg->flags & PS_FL_STICKY);
+		if (ps_has_topic(msg, "snap.int")) {
+			assert(PS_IS_INT(msg) && msg->int_val == -5 && msg->priority == 3);
+		} else if (ps_has_topic(msg, "snap.dbl")) {
+			assert(PS_IS_DBL(msg) && msg->dbl_val == 1.5);
+		} else if (ps_has_topic(msg, "snap.bool")) {
+			assert(PS_IS_BOOL(msg) && msg->bool_val);
+		} else if (ps_has_topic(msg, "snap.str")) {
+			assert(PS_IS_STR(msg) && strcmp(msg->str_val, "hello") == 0);
+		} else if (ps_has_topic(msg, "snap.buf")) {
+			assert(PS_IS_BUF(msg) && (msg->flags & PS_MSK_ENC) == PS_JSON_ENC);
+			assert(msg->buf_val.sz == sizeof(buf) && memcmp(msg->buf_val.ptr, buf, sizeof(buf)) == 0);
+			ps_msg_t *dup = ps_dup_msg(msg); // Shares the mapped data
+			assert(dup->buf_val.ptr == msg->buf_val.ptr);
+			ps_unref_msg(dup);
+		} else if (ps_has_topic(msg, "snap.err")) {
+			assert(PS_IS_ERR(msg) && msg->err_val.id == 42 && strcmp(msg->err_val.desc, "failed") == 0);
+		} else if (ps_has_topic(msg, "snap.nil")) {
+			assert(PS_IS_NIL(msg));
+		} else {
+			assert(ps_has_topic(msg, "snap.long.topic.name.that.doesnt.fit.inline.in.the.message"));
+			assert(msg->int_val == 7);
+		}
+		found++;
+		ps_unref_msg(msg);
+	}
+	assert(found == 8);
+	PS_PUB_STR_FL("snap.str", "bye", PS_FL_STICKY); // Replaces a message pointing into the file
+	ps_flush(s1);
+	ps_free_subscriber(s1);
+	ps_clean_sticky("");
+
+	// A truncated snapshot restores nothing
+	FILE *f = fopen(SNAPSHOT_FILE, "r+");
+	assert(f != NULL);
+	assert(ftruncate(fileno(f), 100) == 0);
+	fclose(f);
+	assert(ps_sticky_load(SNAPSHOT_FILE) == -1);
+	assert(ps_sticky_load("missing.out") == -1);
+	assert(ps_stats_live_msg() == 0);
+	unlink(SNAPSHOT_FILE);
+
+	// An empty snapshot
+	assert(ps_sticky_save(SNAPSHOT_FILE) == 0);
+	assert(ps_sticky_load(SNAPSHOT_FILE) == 0);
+	unlink(SNAPSHOT_FILE);
+	check_leak();
+}
+
+void test_topic_tree(void) {
+	printf("Test topic tree\n");
+	ps_subscriber_t *s1 = ps_new_subscriber(10, PS_STRLIST("a.b.c.d.e.f", "a.b", "a..b", "a."));
+	assert(PS_PUB_NIL("a.b.c.d.e.f.g") == 2);
+	assert(PS_PUB_NIL("a.b.c") == 1);
+	assert(PS_PUB_NIL("a..b.c") == 2);
+	assert(PS_PUB_NIL("a") == 0);
+	assert(ps_subs_count("a.b.c.d.e.f") == 2);
+	ps_flush(s1);
+	ps_free_subscriber(s1);
+
+	PS_PUB_INT_FL("foo.bar", 1, PS_FL_STICKY);
+	PS_PUB_INT_FL("foobar", 2, PS_FL_STICKY);
+	s1 = ps_new_subscriber(10, PS_STRLIST("foo" PS_SUB_CHILDSTICKY));
+	assert(ps_waiting(s1) == 1);
+	ps_free_subscriber(s1);
+	ps_clean_sticky("foo");
+	assert(ps_stats_live_msg() == 1);
+	ps_clean_sticky("foobar");
+	check_leak();
+}
+
+void test_topic_handle(void) {
+	printf("Test topic handle\n");
+	ps_topic_t *t = ps_topic_get("sensors.imu.accel");
+	assert(t != NULL);
+	assert(strcmp(ps_topic_name(t), "sensors.imu.accel") == 0);
+	assert(PS_PUB_TO_INT(t, 1) == 0);
+
+	// The handle outlives subscription churn on its topic
+	ps_subscriber_t *s1 = ps_new_subscriber(10, PS_STRLIST("sensors.imu.accel", "sensors"));
+	assert(PS_PUB_TO_INT(t, 2) == 2);
+	ps_unsubscribe_all(s1);
+	assert(PS_PUB_TO_INT(t, 3) == 0);
+	ps_flush(s1);
+	ps_subscribe(s1, "sensors.imu.accel");
+	assert(PS_PUB_TO_INT(t, 4) == 1);
+	ps_msg_t *msg = ps_get(s1, 0);
+	assert(msg != NULL);
+	assert(msg->int_val == 4);
+	assert(strcmp(msg->topic, "sensors.imu.accel") == 0);
+	ps_msg_t *dup = ps_dup_msg(msg);
+	ps_msg_set_topic(msg, "other");
+	assert(strcmp(dup->topic, "sensors.imu.accel") == 0);
+	ps_unref_msg(msg);
+	ps_unref_msg(dup);
+
+	// Handles and topic strings resolve to the same node
+	assert(PS_PUB_INT("sensors.imu.accel", 5) == 1);
+	assert(ps_topic_ref(t) == t);
+	ps_topic_unref(t);
+	assert(PS_PUB_TO_INT_FL(t, 6, PS_FL_NONRECURSIVE) == 1);
+	ps_flush(s1);
+
+	// Sticky messages through handles
+	PS_PUB_TO_INT_FL(t, 7, PS_FL_STICKY);
+	ps_subscriber_t *s2 = ps_new_subscriber(10, PS_STRLIST("sensors.imu.accel"));
+	msg = ps_get(s2, 0);
+	assert(msg != NULL);
+	assert(msg->int_val == 7);
+	ps_unref_msg(msg);
+	PS_PUB_TO_NIL(t);
+	ps_flush(s1);
+	ps_flush(s2);
+	ps_free_subscriber(s2);
+	s2 = ps_new_subscriber(10, PS_STRLIST("sensors.imu.accel"));
+	assert(ps_waiting(s2) == 0);
+	ps_free_subscriber(s2);
+
+	// Messages keep the topic string after the handle is gone
+	msg = ps_new_msg_to(t, PS_INT_TYP, 8);
+	ps_free_subscriber(s1);
+	ps_topic_unref(t);
+	assert(strcmp(msg->topic, "sensors.imu.accel") == 0);
+	assert(PS_PUB_INT("sensors.imu.accel", 9) == 0);
+	assert(ps_publish(msg) == 0);
+	check_leak();
+}
+
+void test_wildcards(void) {
+	printf("Test wildcards\n");
+	ps_subscriber_t *s1 = ps_new_subscriber(10, PS_STRLIST("fleet.*.status"));
+	ps_subscriber_t *s2 = ps_new_subscriber(10, PS_STRLIST("fleet.#"));
+	ps_subscriber_t *s3 = ps_new_subscriber(10, PS_STRLIST("*.truck1.>", "*"));
+	assert(PS_PUB_INT("fleet.truck1.status", 1) == 4);
+	assert(PS_PUB_INT("fleet.truck2.status", 2) == 3);
+	assert(PS_PUB_INT("fleet.truck1.status.gps", 3) == 4);
+	assert(PS_PUB_INT_FL("fleet.truck1.status.gps", 4, PS_FL_NONRECURSIVE) == 2);
+	assert(PS_PUB_INT("fleet.truck1", 5) == 2);
+	assert(PS_PUB_INT("fleet", 6) == 1);
+	assert(PS_PUB_INT("other.truck2.status", 7) == 1);
+	assert(PS_PUB_INT("", 8) == 0);
+	assert(ps_subs_count("fleet.truck1.status") == 4);
+	assert(ps_waiting(s1) == 3);
+	assert(ps_waiting(s2) == 5);
+	assert(ps_waiting(s3) == 9);
+	ps_msg_t *msg = ps_get(s1, 0);
+	assert(msg->int_val == 1);
+	ps_unref_msg(msg);
+	ps_flush(s1);
+	ps_flush(s2);
+	ps_flush(s3);
+
+	// Tail wildcards only at the end
+	assert(ps_subscribe(s1, "fleet.#.status") == -1);
+	assert(ps_subscribe(s1, "fleet.*.status") == -1);
+
+	// A literal "*" topic segment matches the "*" pattern only once
+	assert(ps_subscribe(s1, "fleet.*") == 0);
+	assert(PS_PUB_INT("fleet.*", 9) == 3);
+	ps_flush(s1);
+	ps_flush(s2);
+	ps_flush(s3);
+
+	assert(ps_unsubscribe(s3, "*.truck1.#") == 0);
+	assert(PS_PUB_INT("fleet.truck1.status", 10) == 4);
+	assert(ps_unsubscribe(s1, "fleet.*.status") == 0);
+	assert(ps_unsubscribe(s1, "fleet.*.status") == -1);
+	ps_free_subscriber(s1);
+	ps_free_subscriber(s2);
+	ps_free_subscriber(s3);
+
+	// Sticky messages of the matching topics
+	PS_PUB_INT_FL("room.kitchen.temp", 20, PS_FL_STICKY);
+	PS_PUB_INT_FL("room.bath.temp", 21, PS_FL_STICKY);
+	PS_PUB_INT_FL("room.bath.temp.max", 30, PS_FL_STICKY);
+	PS_PUB_INT_FL("room.temp", 22, PS_FL_STICKY);
+	s1 = ps_new_subscriber(10, PS_STRLIST("room.*.temp"));
+	assert(ps_waiting(s1) == 2);
+	s2 = ps_new_subscriber(10, PS_STRLIST("room.*.temp" PS_SUB_CHILDSTICKY));
+	assert(ps_waiting(s2) == 3);
+	s3 = ps_new_subscriber(10, PS_STRLIST("room.#"));
+	assert(ps_waiting(s3) == 4);
+	ps_free_subscriber(s1);
+	s1 = ps_new_subscriber(10, PS_STRLIST("*.*.temp" PS_SUB_NOSTICKY));
+	assert(ps_waiting(s1) == 0);
+	ps_free_subscriber(s1);
+	ps_free_subscriber(s2);
+	ps_free_subscriber(s3);
+	check_leak();
+}
+
+static int lazy_builds;
+
+static void lazy_build(ps_msg_t *msg, void *ctx) {
+	lazy_builds++;
+	ps_msg_set_value(msg, PS_INT_TYP, (int64_t) *(int *) ctx);
+}
+
+static int buf_dtors;
+
+static void count_dtor(void *ptr) {
+	buf_dtors++;
+	free(ptr);
+}
+
+void test_publish_lazy(void) {
+	printf("Test publish lazy\n");
+	int val = 42;
+
+	// Nobody listens, nothing is built
+	assert(!ps_has_interest("lazy.a", 0));
+	assert(ps_publish_lazy("lazy.a", 0, lazy_build, &val) == 0);
+	assert(lazy_builds == 0);
+	assert(PS_PUB_BUF("lazy.a", malloc(8), 8, count_dtor) == 0);
+	assert(buf_dtors == 1);
+
+	// Parents and wildcards
+	ps_subscriber_t *s1 = ps_new_subscriber(10, PS_STRLIST("lazy", "wild.*.b"));
+	assert(ps_has_interest("lazy.a", 0));
+	assert(!ps_has_interest("lazy.a", PS_FL_NONRECURSIVE));
+	assert(ps_has_interest("wild.a.b", 0));
+	assert(!ps_has_interest("wild.a.c", 0));
+	assert(ps_publish_lazy("lazy.a", 0, lazy_build, &val) == 1);
+	assert(lazy_builds == 1);
+	ps_msg_t *msg = ps_get(s1, 0);
+	assert(ps_has_topic(msg, "lazy.a") && PS_IS_INT(msg) && msg->int_val == 42);
+	ps_unref_msg(msg);
+	assert(PS_PUB_INT("wild.a.b", 1) == 1);
+	ps_unref_msg(ps_get(s1, 0));
+	ps_free_subscriber(s1);
+
+	// Handles
+	ps_topic_t *t = ps_topic_get("lazy.b");
+	assert(PS_PUB_TO_BUF(t, malloc(8), 8, count_dtor) == 0);
+	assert(buf_dtors == 2);
+	s1 = ps_new_subscriber(10, PS_STRLIST("lazy.b"));
+	assert(PS_PUB_TO_INT(t, 1) == 1);
+	ps_topic_unref(t);
+	ps_free_subscriber(s1);
+
+	// Sticky publishes are always built, and so are the ones clearing a sticky message
+	assert(PS_PUB_INT_FL("lazy.a", 1, PS_FL_STICKY) == 0);
+	assert(ps_has_interest("lazy.a", 0));
+	assert(PS_PUB_INT("lazy.a", 2) == 0);
+	assert(!ps_has_interest("lazy.a", 0));
+	s1 = ps_new_subscriber(10, PS_STRLIST("lazy.a"));
+	assert(ps_waiting(s1) == 0);
+	ps_free_subscriber(s1);
+
+	lazy_builds = buf_dtors = 0;
+	check_leak();
+}
+
+void test_publish_batch(void) {
+	printf("Test publish batch\n");
+	ps_subscriber_t *s1 = ps_new_subscriber(10, PS_STRLIST("a", "b.* h"));
+	ps_subscriber_t *s2 = ps_new_subscriber(3, PS_STRLIST("a.b"));
+	ps_subscriber_t *s3 = ps_new_subscriber(10, PS_STRLIST("a e"));
+	ps_msg_t *msgs[] = {
+	    ps_new_msg("a.b", PS_INT_TYP, 1),
+	    ps_new_msg("b.c", PS_INT_TYP, 2),
+	    ps_new_msg("a.b", PS_INT_TYP | PS_FL_STICKY, 3),
+	    ps_new_msg("a.b", PS_INT_TYP | PS_FL_NONRECURSIVE, 4),
+	    ps_new_msg("c", PS_INT_TYP, 5),
+	    ps_new_msg("a", PS_INT_TYP, 6),
+	};
+	assert(ps_publish_batch(msgs, 6) == 7);
+	assert(ps_waiting(s1) == 4);
+	assert(ps_waiting(s2) == 3);
+	assert(ps_overflow(s2) == 0);
+	assert(ps_waiting(s3) == 1);
+
+	// Each subscriber gets the messages in batch order
+	int64_t expected1[] = {1, 2, 3, 6};
+	for (size_t i = 0; i < 4; i++) {
+		ps_msg_t *msg = ps_get(s1, 0);
+		assert(msg->int_val == expected1[i]);
+		ps_unref_msg(msg);
+	}
+	int64_t expected2[] = {1, 3, 4};
+	for (size_t i = 0; i < 3; i++) {
+		ps_msg_t *msg = ps_get(s2, 0);
+		assert(msg->int_val == expected2[i]);
+		ps_unref_msg(msg);
+	}
+	ps_flush(s3);
+
+	// Overflowed deliveries aren't counted
+	ps_msg_t *more[] = {
+	    ps_new_msg("a.b", PS_INT_TYP, 7),
+	    ps_new_msg("a.b", PS_INT_TYP, 8),
+	    ps_new_msg("a.b", PS_INT_TYP, 9),
+	    ps_new_msg("a.b", PS_INT_TYP, 10),
+	    NULL,
+	};
+	assert(ps_publish_batch(more, 5) == 8);
+	assert(ps_overflow(s2) == 1);
+	assert(ps_waiting(s2) == 3);
+	ps_free_subscriber(s1);
+	ps_free_subscriber(s2);
+	ps_free_subscriber(s3);
+	check_leak();
+}
+
+void test_get_many(void) {
+	printf("Test get many\n");
+	ps_msg_t *msgs[4];
+	ps_subscriber_t *s1 = ps_new_subscriber(10, PS_STRLIST("a", "b" PS_SUB_PRIO(5)));
+	assert(ps_get_many(s1, msgs, 4, 0) == 0);
+	assert(ps_get_many(s1, msgs, 4, 10) == 0);
+	for (int i = 0; i < 5; i++) {
+		PS_PUB_INT("a", i);
+	}
+	PS_PUB_INT("b", 10);
+	assert(ps_get_many(s1, msgs, 0, 0) == 0);
+	assert(ps_get_many(s1, msgs, 4, 0) == 4);
+	assert(ps_waiting(s1) == 2);
+
+#ifdef PS_QUEUE_BUCKET
+	// Priority order first, then arrival order
+	int64_t expected[] = {10, 0, 1, 2, 3, 4};
+#else
+	// No priorities, arrival order
+	int64_t expected[] = {0, 1, 2, 3, 4, 10};
+#endif
+	for (size_t i = 0; i < 4; i++) {
+		assert(msgs[i]->int_val == expected[i]);
+		ps_unref_msg(msgs[i]);
+	}
+	assert(ps_get_many(s1, msgs, 4, -1) == 2);
+	assert(msgs[0]->int_val == expected[4]);
+	assert(msgs[1]->int_val == expected[5]);
+	ps_unref_msg(msgs[0]);
+	ps_unref_msg(msgs[1]);
+	assert(ps_waiting(s1) == 0);
+	ps_free_subscriber(s1);
+	check_leak();
+}
+
+void test_get_no_wait(void) {
+	printf("Test get no wait\n");
+	ps_subscriber_t *s1 = ps_new_subscriber(10, PS_STRLIST("a"));
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i = 0; i < 2000; i++) {
+		assert(ps_get(s1, 0) == NULL);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	// A zero timeout doesn't sleep for the timer slack (~50 us) on each empty get
+	assert((end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000 < 50);
+	ps_free_subscriber(s1);
+	check_leak();
+}
+
+static bool fd_readable(int fd) {
+	struct pollfd pfd = {.fd = fd, .events = POLLIN};
+	return poll(&pfd, 1, 0) == 1;
+}
+
+void test_subscriber_fd(void) {
+	printf("Test subscriber fd\n");
+	uint64_t count = 0;
+	ps_subscriber_t *s1 = ps_new_subscriber(10, PS_STRLIST("a"));
+	PS_PUB_INT("a", 1);
+
+	// Already non-empty when requested
+	int fd = ps_subscriber_fd(s1);
+	assert(fd >= 0);
+	assert(ps_subscriber_fd(s1) == fd);
+	assert(fd_readable(fd));
+	assert(read(fd, &count, sizeof(count)) == sizeof(count));
+	assert(!fd_readable(fd));
+
+	// No new edge while it isn't drained
+	PS_PUB_INT("a", 2);
+	assert(!fd_readable(fd));
+	ps_msg_t *msgs[4];
+	assert(ps_get_many(s1, msgs, 4, 0) == 2);
+	ps_unref_msg(msgs[0]);
+	ps_unref_msg(msgs[1]);
+
+	// One signal per empty to non-empty transition
+	for (int i = 0; i < 3; i++) {
+		PS_PUB_INT("a", i);
+	}
+	ps_msg_t *batch[] = {ps_new_msg("a", PS_INT_TYP, (int64_t) 3), ps_new_msg("a", PS_INT_TYP, (int64_t) 4)};
+	ps_publish_batch(batch, 2);
+	assert(read(fd, &count, sizeof(count)) == sizeof(count));
+	assert(count == 1);
+	assert(ps_flush(s1) == 5);
+	PS_PUB_INT("a", 3);
+	assert(read(fd, &count, sizeof(count)) == sizeof(count));
+	assert(count == 1);
+
+	ps_free_subscriber(s1);
+	check_leak();
+}
+
 void test_no_recursive(void) {
 	printf("Test no recursive\n");
 	ps_subscriber_t *s1 = ps_new_subscriber(10, PS_STRLIST("foo.bar"));
@@ -371,6 +986,136 @@ void test_new_msg_cb(void) {
 	check_leak();
 }
 
+static void republish_cb(ps_subscriber_t *su) {
+	(void) su; // unused
+	// Same shard as the sticky publish that triggered us
+	PS_PUB_INT_FL("cb.b", 2, PS_FL_STICKY);
+}
+
+static void free_self_cb(ps_subscriber_t *su) {
+	ps_free_subscriber(su);
+}
+
+void test_callback_reentrancy(void) {
+	printf("Test callback reentrancy\n");
+	ps_subscriber_t *s1 = ps_new_subscriber(10, PS_STRLIST("cb.a"));
+	ps_subscriber_t *s2 = ps_new_subscriber(10, PS_STRLIST("cb.b"));
+	ps_set_new_msg_cb(s1, republish_cb);
+	PS_PUB_INT_FL("cb.a", 1, PS_FL_STICKY);
+	assert(ps_waiting(s1) == 1);
+	assert(ps_waiting(s2) == 1);
+
+	ps_subscriber_t *s3 = ps_new_subscriber(10, PS_STRLIST("cb.free"));
+	ps_set_new_msg_cb(s3, free_self_cb);
+	assert(ps_stats_live_subscribers() == 3);
+	assert(PS_PUB_INT("cb.free", 1) == 1);
+	assert(ps_stats_live_subscribers() == 2);
+
+	ps_free_subscriber(s1);
+	ps_free_subscriber(s2);
+	check_leak();
+}
+
+#define DISPATCH_SUBS 8
+#define DISPATCH_MSGS 1000
+
+typedef struct dispatch_state_s {
+	int64_t last;
+	uint32_t running;
+	bool ordered;
+} dispatch_state_t;
+
+static uint32_t dispatch_handled;
+
+static void dispatch_handler(ps_subscriber_t *su, ps_msg_t *msg) {
+	dispatch_state_t *st = ps_subscriber_user_data(su);
+	// Never run by two workers at once, and in publish order
+	if (__atomic_add_fetch(&st->running, 1, __ATOMIC_SEQ_CST) != 1 || msg->int_val != st->last + 1) {
+		st->ordered = false;
+	}
+	st->last = msg->int_val;
+	__atomic_sub_fetch(&st->running, 1, __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&dispatch_handled, 1, __ATOMIC_SEQ_CST);
+}
+
+static void dispatch_free_handler(ps_subscriber_t *su, ps_msg_t *msg) {
+	(void) msg; // unused
+	ps_free_subscriber(su);
+	__atomic_add_fetch(&dispatch_handled, 1, __ATOMIC_SEQ_CST);
+}
+
+static void wait_handled(uint32_t n) {
+	for (int i = 0; i < 5000 && __atomic_load_n(&dispatch_handled, __ATOMIC_SEQ_CST) < n; i++) {
+		usleep(1000);
+	}
+	assert(__atomic_load_n(&dispatch_handled, __ATOMIC_SEQ_CST) == n);
+}
+
+void test_dispatcher(void) {
+	printf("Test dispatcher\n");
+	ps_subscriber_t *subs[DISPATCH_SUBS];
+	dispatch_state_t states[DISPATCH_SUBS];
+	char topic[32];
+	dispatch_handled = 0;
+
+	ps_dispatcher_t *d = ps_new_dispatcher(4);
+	assert(d != NULL);
+	for (int i = 0; i < DISPATCH_SUBS; i++) {
+		snprintf(topic, sizeof(topic), "disp.%d", i);
+		subs[i] = ps_new_subscriber(DISPATCH_MSGS, PS_STRLIST(topic));
+		states[i] = (dispatch_state_t){.last = -1, .ordered = true};
+		ps_subscriber_user_data_set(subs[i], &states[i]);
+	}
+	// Messages queued before adding are handled too
+	PS_PUB_INT("disp.0", 0);
+	for (int i = 0; i < DISPATCH_SUBS; i++) {
+		assert(ps_dispatcher_add(d, subs[i], dispatch_handler) == 0);
+	}
+	assert(ps_dispatcher_add(d, subs[0], dispatch_handler) == -1);
+	for (int n = 0; n < DISPATCH_MSGS; n++) {
+		for (int i = 0; i < DISPATCH_SUBS; i++) {
+			if (i != 0 || n != 0) {
+				snprintf(topic, sizeof(topic), "disp.%d", i);
+				PS_PUB_INT(topic, n);
+			}
+		}
+	}
+	wait_handled(DISPATCH_SUBS * DISPATCH_MSGS);
+	for (int i = 0; i < DISPATCH_SUBS; i++) {
+		assert(states[i].ordered);
+		assert(states[i].last == DISPATCH_MSGS - 1);
+	}
+
+	// Removed subscribers go back to ps_get
+	assert(ps_dispatcher_remove(subs[0]) == 0);
+	assert(ps_dispatcher_remove(subs[0]) == -1);
+	PS_PUB_INT("disp.0", 1);
+	assert(ps_waiting(subs[0]) == 1);
+
+	// A handler can free its own subscriber
+	ps_subscriber_t *s1 = ps_new_subscriber(10, PS_STRLIST("disp.free"));
+	assert(ps_dispatcher_add(d, s1, dispatch_free_handler) == 0);
+	PS_PUB_INT("disp.free", 1);
+	wait_handled(DISPATCH_SUBS * DISPATCH_MSGS + 1);
+	for (int i = 0; i < 1000 && ps_stats_live_subscribers() != DISPATCH_SUBS; i++) {
+		usleep(1000);
+	}
+	assert(ps_stats_live_subscribers() == DISPATCH_SUBS);
+
+	// Freeing the dispatcher removes the subscribers still added
+	ps_free_dispatcher(d);
+	assert(ps_dispatcher_remove(subs[1]) == -1);
+	PS_PUB_INT("disp.1", 1);
+	assert(ps_waiting(subs[1]) == 1);
+	d = ps_new_dispatcher(1);
+	assert(ps_dispatcher_add(d, subs[1], dispatch_handler) == 0);
+	ps_free_dispatcher(d);
+	for (int i = 0; i < DISPATCH_SUBS; i++) {
+		ps_free_subscriber(subs[i]);
+	}
+	check_leak();
+}
+
 void test_call(void) {
 	printf("Test call\n");
 	ps_msg_t *msg = NULL;
@@ -391,6 +1136,176 @@ void test_call(void) {
 	check_leak();
 }
 
+void test_call_channel(void) {
+	printf("Test call channel\n");
+	pthread_t thread;
+	pthread_create(&thread, NULL, rpc_thread, NULL);
+	ps_msg_t *msg = ps_wait_one("rpc.ready", 5000);
+	assert(msg != NULL);
+	ps_unref_msg(msg);
+	ps_clean_sticky("rpc.ready");
+
+	uint32_t call_id = 0;
+	for (int i = 0; i < 100; i++) {
+		msg = PS_CALL_INT(i % 2 ? "rpc.twice" : "rpc.echo", i, 1000); // Second replies are dropped
+		assert(msg != NULL && msg->int_val == i + 1);
+		assert(msg->call_id != 0 && msg->call_id != call_id);
+		call_id = msg->call_id;
+		ps_unref_msg(msg);
+	}
+	assert(ps_stats_live_subscribers() == 1); // The reply channel isn't a user subscriber
+
+	msg = PS_CALL_INT("rpc.exact", 5, 1000); // The reply topic is the subscribed one
+	assert(msg != NULL && msg->int_val == 6);
+	ps_unref_msg(msg);
+
+	msg = PS_CALL_INT("rpc.slow", 0, 5); // Its reply arrives during the next call
+	assert(msg == NULL);
+	msg = PS_CALL_INT("rpc.echo", 10, 1000);
+	assert(msg != NULL && msg->int_val == 11);
+	ps_unref_msg(msg);
+
+	ps_subscriber_t *s1 = ps_new_subscriber(10, PS_STRLIST("nest"));
+	ps_set_new_msg_cb(s1, nested_call_cb);
+	msg = PS_CALL_INT("nest", 20, 1000);
+	assert(msg != NULL && msg->int_val == 21);
+	ps_unref_msg(msg);
+	ps_free_subscriber(s1);
+
+	// The reply channel of a thread goes away with it
+	char rtopic[32];
+	pthread_t caller;
+	pthread_create(&caller, NULL, caller_thread, rtopic);
+	pthread_join(caller, NULL);
+	assert(ps_subs_count(rtopic) == 0);
+
+	PS_PUB_NIL("rpc.stop");
+	pthread_join(thread, NULL);
+	check_leak();
+}
+
+void test_call_async(void) {
+	printf("Test call async\n");
+	pthread_t thread;
+	pthread_create(&thread, NULL, rpc_thread, NULL);
+	ps_msg_t *msg = ps_wait_one("rpc.ready", 5000);
+	assert(msg != NULL);
+	ps_unref_msg(msg);
+	ps_clean_sticky("rpc.ready");
+
+	static ps_call_t *calls[ASYNC_CALLS];
+	for (int i = 0; i < ASYNC_CALLS; i++) {
+		calls[i] = ps_call_start(ps_new_msg("rpc.echo", PS_INT_TYP, (int64_t) i), 5000);
+	}
+	for (int i = ASYNC_CALLS - 1; i >= 0; i--) {
+		msg = ps_call_wait(calls[i]);
+		assert(msg != NULL && msg->int_val == i + 1);
+		ps_unref_msg(msg);
+	}
+
+	static int values[ASYNC_CALLS];
+	async_replies = 0;
+	for (int i = 0; i < ASYNC_CALLS; i++) {
+		values[i] = i;
+		assert(ps_call_async(ps_new_msg("rpc.echo", PS_INT_TYP, (int64_t) i), 5000, async_cb, &values[i]) == 1);
+	}
+	wait_async_replies(ASYNC_CALLS);
+
+	// Timeouts expire in deadline order, whatever the order of the calls
+	ps_subscriber_t *s1 = ps_new_subscriber(10, PS_STRLIST("mute"));
+	async_replies = 0;
+	async_timeouts = 0;
+	ps_call_async(ps_new_msg("mute", PS_INT_TYP, (int64_t) 0), 30, async_cb, &values[30]);
+	ps_call_async(ps_new_msg("mute", PS_INT_TYP, (int64_t) 0), 10, async_cb, &values[10]);
+	ps_call_async(ps_new_msg("mute", PS_INT_TYP, (int64_t) 0), 20, async_cb, &values[20]);
+	wait_async_replies(3);
+	assert(async_order[0] == 10 && async_order[1] == 20 && async_order[2] == 30);
+	ps_free_subscriber(s1);
+
+	msg = ps_call_wait(ps_call_start(ps_new_msg("rpc.exact", PS_INT_TYP, (int64_t) 7), 1000));
+	assert(msg != NULL && msg->int_val == 8);
+	ps_unref_msg(msg);
+
+	msg = ps_call_wait(ps_call_start(ps_new_msg("rpc.slow", PS_INT_TYP, (int64_t) 0), 5));
+	assert(msg == NULL);
+	msg = ps_call_wait(ps_call_start(ps_new_msg("nobody", PS_INT_TYP, (int64_t) 0), -1)); // Completes at once
+	assert(msg == NULL);
+
+	// A reply arriving when the reply queue is full still completes its call, and the others aren't failed
+	call_thread_blocked = 0;
+	ps_call_async(ps_new_msg("rpc.echo", PS_INT_TYP, (int64_t) 0), 5000, blocking_cb, NULL);
+	while (__atomic_load_n(&call_thread_blocked, __ATOMIC_ACQUIRE) == 0) {
+		usleep(1000);
+	}
+	s1 = ps_new_subscriber(1, PS_STRLIST("flood"));
+	ps_call_t *call = ps_call_start(ps_new_msg("flood", PS_NIL_TYP), -1);
+	msg = ps_get(s1, 1000);
+	assert(msg != NULL);
+	for (int i = 0; i < 5000; i++) { // More messages that aren't replies than the queue holds
+		assert(PS_PUB_NIL(msg->rtopic) == 1);
+	}
+	ps_call_t *slow = ps_call_start(ps_new_msg("rpc.slow", PS_INT_TYP, (int64_t) 1), 5000);
+	assert(PS_REPLY_INT(msg, 42) == 1);
+	ps_unref_msg(msg);
+	__atomic_store_n(&call_thread_blocked, 2, __ATOMIC_RELEASE);
+	msg = ps_call_wait(call);
+	assert(msg != NULL && msg->int_val == 42);
+	ps_unref_msg(msg);
+	msg = ps_call_wait(slow);
+	assert(msg != NULL && msg->int_val == 2);
+	ps_unref_msg(msg);
+	ps_free_subscriber(s1);
+	for (int i = 0; i < 5000 && ps_stats_live_msg() != 0; i++) { // The call thread may still be dropping the flood
+		usleep(1000);
+	}
+
+	PS_PUB_NIL("rpc.stop");
+	pthread_join(thread, NULL);
+	check_leak();
+}
+
+#define RESPONDERS 20
+
+void test_call_all(void) {
+	printf("Test call all\n");
+	pthread_t threads[RESPONDERS];
+	ps_subscriber_t *su[RESPONDERS];
+	for (int i = 0; i < RESPONDERS; i++) {
+		su[i] = ps_new_subscriber(10, PS_STRLIST("health"));
+		ps_subscriber_user_data_set(su[i], (void *) (intptr_t) (i + 1));
+		pthread_create(&threads[i], NULL, responder_thread, su[i]);
+	}
+	ps_subscriber_t *mute = ps_new_subscriber(10, PS_STRLIST("health" PS_SUB_HIDDEN)); // Not waited for
+
+	ps_msg_t *replies[RESPONDERS + 1];
+	int sum = 0;
+	size_t n = ps_call_all(ps_new_msg("health.check", PS_NIL_TYP), 5000, replies, RESPONDERS + 1);
+	assert(n == RESPONDERS); // Returns as soon as all of them answered
+	for (size_t i = 0; i < n; i++) {
+		sum += replies[i]->int_val;
+		ps_unref_msg(replies[i]);
+	}
+	assert(sum == RESPONDERS * (RESPONDERS + 1) / 2);
+
+	n = ps_call_all(ps_new_msg("health.check", PS_NIL_TYP), 5000, replies, 5);
+	assert(n == 5);
+	for (size_t i = 0; i < n; i++) {
+		ps_unref_msg(replies[i]);
+	}
+	assert(ps_call_all(ps_new_msg("nobody", PS_NIL_TYP), 5000, replies, 5) == 0);
+
+	PS_PUB_NIL("health");
+	for (int i = 0; i < RESPONDERS; i++) {
+		pthread_join(threads[i], NULL);
+		ps_free_subscriber(su[i]);
+	}
+	ps_subscriber_t *slow = ps_new_subscriber(10, PS_STRLIST("health"));
+	assert(ps_call_all(ps_new_msg("health.check", PS_NIL_TYP), 10, replies, 5) == 0); // Times out
+	ps_free_subscriber(slow);
+	ps_free_subscriber(mute);
+	check_leak();
+}
+
 void test_no_return_path(void) {
 	printf("Test no return path\n");
 	ps_msg_t *msg = NULL;
@@ -439,6 +1354,56 @@ void test_topic_prefix_suffix(void) {
 	check_leak();
 }
 
+#define LONG_TOPIC "sensors.building_a.floor_3.room_301.thermostat.temperature"
+
+void test_topic_storage(void) {
+	printf("Test topic storage\n");
+	ps_subscriber_t *s1 = ps_new_subscriber(4, PS_STRLIST("short", LONG_TOPIC));
+
+	// Short topics live in the message
+	ps_msg_t *msg = ps_new_msg("short", PS_NIL_TYP);
+	assert(msg->topic == (char *) (msg + 1));
+	assert(ps_has_topic(msg, "short") && ps_has_topic(msg, "shor") && !ps_has_topic(msg, "shortest"));
+	ps_msg_t *dup = ps_dup_msg(msg);
+	assert(dup->topic != msg->topic && strcmp(dup->topic, "short") == 0);
+	ps_unref_msg(msg);
+	ps_unref_msg(dup);
+
+	// Long topics published with PS_PUB_* or through a handle share the name of their subscribed node, messages
+	// created with ps_new_msg get a copy
+	ps_topic_t *t = ps_topic_get(LONG_TOPIC);
+	PS_PUB_INT(LONG_TOPIC, 1);
+	PS_PUB_TO_INT(t, 2);
+	ps_publish(ps_new_msg(LONG_TOPIC, PS_INT_TYP, (int64_t) 3));
+	msg = ps_get(s1, 0);
+	assert(ps_has_topic(msg, LONG_TOPIC) && ps_has_topic_suffix(msg, ".temperature"));
+	dup = ps_get(s1, 0);
+	assert(msg->topic == dup->topic && msg->topic == ps_topic_name(t));
+	ps_unref_msg(dup);
+	dup = ps_get(s1, 0);
+	assert(dup->topic != msg->topic && strcmp(dup->topic, LONG_TOPIC) == 0);
+	ps_unref_msg(dup);
+	ps_topic_unref(t);
+
+	// The name outlives its node
+	ps_unsubscribe(s1, LONG_TOPIC);
+	assert(ps_has_topic(msg, LONG_TOPIC));
+	dup = ps_dup_msg(msg);
+	ps_unref_msg(msg);
+	assert(strcmp(dup->topic, LONG_TOPIC) == 0);
+
+	ps_msg_set_topic(dup, LONG_TOPIC ".unknown");
+	assert(ps_has_topic(dup, LONG_TOPIC ".unknown") && ps_has_topic_prefix(dup, LONG_TOPIC));
+	ps_msg_set_topic(dup, "short");
+	assert(ps_has_topic(dup, "short"));
+	ps_msg_set_topic(dup, NULL);
+	assert(dup->topic == NULL);
+	ps_unref_msg(dup);
+
+	ps_free_subscriber(s1);
+	check_leak();
+}
+
 void test_msg_getset(void) {
 	printf("Test msg getset values\n");
 	ps_subscriber_t *su = ps_new_subscriber(1, PS_STRLIST("foo"));
@@ -495,9 +1460,16 @@ void test_dup_msg(void) {
 	assert(strcmp(msg->topic, dup->topic) == 0);
 	assert(strcmp(msg->rtopic, dup->rtopic) == 0);
 	assert(msg->flags == dup->flags);
-	assert(dup->str_val != msg->str_val);
+	assert(dup->str_val == msg->str_val);
+	assert(strcmp(msg->str_val, "bar") == 0);
+	ps_msg_t *dup2 = ps_dup_msg(dup);
+	assert(dup2->str_val == msg->str_val);
+	ps_msg_set_value(dup, PS_STR_TYP, "baz"); // Doesn't affect the other copies
+	assert(strcmp(dup->str_val, "baz") == 0);
 	assert(strcmp(msg->str_val, "bar") == 0);
 	ps_unref_msg(msg);
+	assert(strcmp(dup2->str_val, "bar") == 0);
+	ps_unref_msg(dup2);
 	ps_unref_msg(dup);
 
 	uint8_t *buf = calloc(3, sizeof(uint8_t));
@@ -505,11 +1477,21 @@ void test_dup_msg(void) {
 	msg = ps_new_msg("foo", PS_BUF_TYP, (void *) buf, 3, free);
 	ps_msg_set_rtopic(msg, "baz");
 	dup = ps_dup_msg(msg);
-	assert(dup->buf_val.ptr != msg->buf_val.ptr);
-	assert(((uint8_t *) dup->buf_val.ptr)[0] == 0x42);
+	assert(dup->buf_val.ptr == msg->buf_val.ptr);
 	assert(dup->buf_val.sz == 3);
 	assert(dup->buf_val.dtor == free);
 	ps_unref_msg(msg);
+	assert(((uint8_t *) dup->buf_val.ptr)[0] == 0x42);
+	ps_unref_msg(dup);
+
+	// Buffers not owned by the message are copied
+	uint8_t data[3] = {0x42};
+	msg = ps_new_msg("foo", PS_BUF_TYP, (void *) data, 3, NULL);
+	dup = ps_dup_msg(msg);
+	ps_unref_msg(msg);
+	assert(dup->buf_val.ptr != data);
+	assert(((uint8_t *) dup->buf_val.ptr)[0] == 0x42);
+	assert(dup->buf_val.dtor == free);
 	ps_unref_msg(dup);
 
 	char err[] = "error";
@@ -537,7 +1519,7 @@ void test_subscriber_userdata(void) {
 void test_priority(void) {
 	printf("Test priority\n");
 
-#ifdef PS_QUEUE_LL
+#ifndef PS_QUEUE_BUCKET
 	printf(">> WARNING: The selected queue implemetation doesn't support priorities\n");
 	return;
 #endif
@@ -574,6 +1556,116 @@ void test_priority(void) {
 	check_leak();
 }
 
+void test_concurrent_publish(void) {
+	printf("Test concurrent publish\n");
+	pthread_t threads[CONCURRENT_THREADS];
+	ps_subscriber_t *s1 = ps_new_subscriber(CONCURRENT_THREADS * CONCURRENT_MSGS + 200, PS_STRLIST("conc"));
+	for (int i = 0; i < CONCURRENT_THREADS; i++) {
+		pthread_create(&threads[i], NULL, publisher_thread, (void *) (intptr_t) i);
+	}
+	// Subscription churn while the publishers are running
+	for (int i = 0; i < 200; i++) {
+		ps_subscriber_t *s2 = ps_new_subscriber(10, PS_STRLIST("conc.t0", "conc.t1", "conc"));
+		PS_PUB_INT_FL("conc.sticky", i, PS_FL_STICKY);
+		ps_free_subscriber(s2);
+	}
+	for (int i = 0; i < CONCURRENT_THREADS; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	assert(ps_waiting(s1) == CONCURRENT_THREADS * CONCURRENT_MSGS + 200);
+	ps_free_subscriber(s1);
+	check_leak();
+}
+
+void test_shards(void) {
+	printf("Test shards\n");
+	ps_deinit();
+	ps_init_opts(&(ps_opts_t){.shards = 3});
+	PS_PUB_INT_FL("foo.bar", 1, PS_FL_STICKY);
+	PS_PUB_INT_FL("baz.qux", 2, PS_FL_STICKY);
+	ps_subscriber_t *s1 = ps_new_subscriber(10, PS_STRLIST("foo", "baz.qux", "" PS_SUB_CHILDSTICKY));
+	assert(ps_waiting(s1) == 3);
+	assert(PS_PUB_NIL("baz.qux.quux") == 2);
+	assert(ps_subs_count("foo.bar") == 1);
+	ps_free_subscriber(s1);
+	ps_deinit();
+	ps_init();
+	check_leak();
+}
+
+#define POOL_MSGS 100
+
+static void *unref_thread(void *v) {
+	ps_msg_t **msgs = v;
+	for (int i = 0; i < POOL_MSGS; i++) {
+		ps_unref_msg(msgs[i]);
+	}
+	return NULL;
+}
+
+#define POOL_THREADS 100
+
+static void *pool_publisher_thread(void *v) {
+	(void) v; // unused
+	for (int i = 0; i < POOL_MSGS; i++) {
+		PS_PUB_INT("pool", i);
+	}
+	return NULL;
+}
+
+void test_msg_pool(void) {
+	printf("Test msg pool\n");
+	ps_msg_t *msgs[POOL_MSGS];
+	pthread_t thread;
+	ps_deinit();
+	ps_init_opts(&(ps_opts_t){.msg_pool = true});
+
+	// Freed messages are reused by the same thread
+	ps_msg_t *msg = ps_new_msg("foo", PS_STR_TYP, "bar");
+	ps_unref_msg(msg);
+	assert(ps_new_msg("foo", PS_INT_TYP, (int64_t) 1) == msg);
+	assert(msg->int_val == 1 && msg->rtopic == NULL);
+	ps_msg_t *dup = ps_dup_msg(msg);
+	assert(dup != msg && dup->int_val == 1 && strcmp(dup->topic, "foo") == 0);
+	ps_unref_msg(dup);
+	ps_unref_msg(msg);
+
+	// Messages freed by another thread go back to this one
+	ps_subscriber_t *s1 = ps_new_subscriber(POOL_MSGS, PS_STRLIST("pool"));
+	for (int i = 0; i < POOL_MSGS; i++) {
+		PS_PUB_INT("pool", i);
+	}
+	for (int i = 0; i < POOL_MSGS; i++) {
+		msgs[i] = ps_get(s1, 0);
+		assert(msgs[i] != NULL && msgs[i]->int_val == i);
+	}
+	pthread_create(&thread, NULL, unref_thread, msgs);
+	pthread_join(thread, NULL);
+	assert(ps_stats_live_msg() == 0);
+	for (int i = 0; i < POOL_MSGS; i++) {
+		PS_PUB_INT("pool", i);
+	}
+	assert(ps_flush(s1) == POOL_MSGS);
+	ps_free_subscriber(s1);
+
+	// The caches of threads that exit are closed, their messages are freed when the consumer releases them
+	s1 = ps_new_subscriber(POOL_THREADS * POOL_MSGS, PS_STRLIST("pool"));
+	for (int i = 0; i < POOL_THREADS; i++) {
+		pthread_create(&thread, NULL, pool_publisher_thread, NULL);
+		pthread_join(thread, NULL);
+	}
+	assert(ps_flush(s1) == POOL_THREADS * POOL_MSGS);
+	ps_free_subscriber(s1);
+	check_leak();
+
+	// A message released after ps_deinit doesn't go back to the freed pool
+	msg = ps_new_msg("foo", PS_INT_TYP, (int64_t) 1);
+	ps_deinit();
+	ps_unref_msg(msg);
+	check_leak();
+	ps_init();
+}
+
 void test_compatibility(void) {
 #ifndef PS_DEPRECATE_NO_PREFIX
 	printf("Test compatibility\n");
@@ -601,6 +1693,7 @@ void run_all(void) {
 	test_hidden_subscription();
 	test_weird_subscription();
 	test_subscribe_many();
+	test_subscriber_churn();
 	test_subs_count();
 	test_publish();
 	test_sticky();
@@ -608,19 +1701,38 @@ void run_all(void) {
 	test_clean_all_children_sticky();
 	test_no_sticky_flag();
 	test_child_sticky_flag();
+	test_child_sticky_index();
+	test_sticky_snapshot();
+	test_topic_tree();
+	test_topic_handle();
+	test_wildcards();
+	test_publish_lazy();
+	test_publish_batch();
+	test_get_many();
+	test_get_no_wait();
+	test_subscriber_fd();
 	test_no_recursive();
 	test_on_empty();
 	test_unsub_on_empty();
 	test_pub_get();
 	test_overflow();
 	test_new_msg_cb();
+	test_callback_reentrancy();
+	test_dispatcher();
 	test_call();
+	test_call_channel();
+	test_call_async();
+	test_call_all();
 	test_no_return_path();
 	test_topic_prefix_suffix();
+	test_topic_storage();
 	test_msg_getset();
 	test_dup_msg();
 	test_subscriber_userdata();
 	test_priority();
+	test_concurrent_publish();
+	test_shards();
+	test_msg_pool();
 	test_compatibility();
 	printf("All tests passed!\n");
 }